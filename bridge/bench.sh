@@ -0,0 +1,51 @@
+#!/bin/bash
+# Runs the same load through the epoll and the io_uring backend.
+# A vcan interface is bridged to a multicast group the bridge itself listens on,
+# so every frame generated by cangen crosses the bridge in both directions.
+set -e
+
+IFACE=${IFACE:-eth0}
+FRAMES=${FRAMES:-100000}
+CANIF=bench0
+GROUP="ff02::cafe%$IFACE"
+PORT=29999
+
+sudo ip link add name "$CANIF" type vcan 2>/dev/null || true
+sudo ip link set "$CANIF" mtu 72
+sudo ip link set "$CANIF" up
+
+make -C "$(dirname "$0")"
+
+for backend in epoll io_uring; do
+  perf_pid=
+  syscalls=
+  "$(dirname "$0")/cannelloni_bridge" -b "$backend" "$CANIF:$GROUP:$PORT" >/dev/null &
+  pid=$!
+  sleep 1
+
+  if command -v perf >/dev/null; then
+    sudo perf stat -e raw_syscalls:sys_enter -p "$pid" -o "/tmp/bench-$backend.perf" &
+    perf_pid=$!
+  fi
+
+  timeout 30 candump -n $((FRAMES * 2)) "$CANIF" >/dev/null &
+  dump_pid=$!
+  start=$(date +%s.%N)
+  cangen "$CANIF" -g 0 -I i -L i -D i -n "$FRAMES"
+  wait "$dump_pid" && received=$((FRAMES * 2)) || received="timeout"
+  end=$(date +%s.%N)
+
+  read -r -a stat <"/proc/$pid/stat"
+  ticks=$(getconf CLK_TCK)
+  cpu=$(echo "scale=3; (${stat[13]} + ${stat[14]}) / $ticks" | bc)
+
+  if [ -n "$perf_pid" ]; then
+    sudo kill -INT "$perf_pid"
+    wait "$perf_pid" || true
+    syscalls=$(awk '/raw_syscalls/ { gsub(",", "", $1); print $1 }' "/tmp/bench-$backend.perf")
+  fi
+  kill "$pid"
+  wait "$pid" 2>/dev/null || true
+
+  echo "$backend: $FRAMES frames, received $received, wall $(echo "$end - $start" | bc)s, cpu ${cpu}s, syscalls ${syscalls:-n/a}"
+done
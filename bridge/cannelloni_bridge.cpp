@@ -1,263 +1,3314 @@
 #include <arpa/inet.h>
+#include <getopt.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/io_uring.h>
+#include <linux/net_tstamp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <net/if.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
-#include <vector>
+#include <stdarg.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <map>
-#include <utility>
 #include <memory>
+#include <optional>
+#include <string>
 #include <thread>
+#include <vector>
 #include <avahi-client/client.h>
 #include <avahi-client/lookup.h>
 #include <avahi-common/error.h>
 #include <avahi-common/malloc.h>
-#include <avahi-common/simple-watch.h>
+#include <avahi-common/watch.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
-#include <sstream>
 
-class Endpoint {
- public:
-  virtual void read(std::vector<struct can_frame> &frames) = 0;
-  virtual void write(std::vector<struct can_frame> &frames) = 0;
+// cannelloni wire format, see src/cannelloni.h
+#define CANNELLONI_FRAME_VERSION 2
+#define CANNELLONI_DATA_PACKET_BASE_SIZE 5
+#define CANNELLONI_FRAME_BASE_SIZE 5
+#define CANFD_FRAME 0x80
+// op code flag: the header is followed by the send time and every frame starts with its receive time,
+// both big endian microseconds of the gateway's free-running clock
+#define CNL_OP_TIMESTAMPS 0x40
+#define CNL_TIMESTAMP_SIZE 4
+// clock exchange: the request carries its send time and the times of the previous exchange,
+// the reply the request's send time, the gateway's receive and send times and whether its clock is synced
+#define CNL_TIME_REQUEST_SIZE (CANNELLONI_DATA_PACKET_BASE_SIZE + 3 * 8)
+#define CNL_TIME_REPLY_SIZE (CANNELLONI_DATA_PACKET_BASE_SIZE + 3 * 8 + 1)
+// raw Ethernet transport: datagrams in frames of this EtherType, after the big endian port of their channel
+#define CNL_ETHERTYPE 0x88B5
+#define CNL_ETH_PORT_SIZE 2
+
+// largest datagram we send, fits into a single lwIP pbuf on the gateway
+#define CANNELLONI_MAX_DATAGRAM 1200
+// frames moved between endpoints at once
+#define FRAME_BATCH_SIZE 64
+// maximum number of bridges served by one runner
+#define MAX_BRIDGES 64
+// pending bridge additions/removals handed to a runner
+#define COMMAND_QUEUE_SIZE 64
+// frames an endpoint buffers while its socket pushes back, power of two
+#define TX_QUEUE_SIZE 256
+// retry interval of queues stalled by ENOBUFS, which never signals EPOLLOUT
+#define TX_RETRY_NS 1000000
+// interval of the clock exchanges with every gateway
+#define CLOCK_SYNC_INTERVAL_MS 1000
+// backoff between attempts to reopen a failed endpoint
+#define REOPEN_MIN_MS 100
+#define REOPEN_MAX_MS 10000
+// CAN_RAW_FILTER rules per bridge
+#define CAN_FILTER_MAX 16
+// histogram buckets, bucket i counts values up to 2^i, the last one everything above
+#define BATCH_HISTOGRAM_BUCKETS 8
+#define LOOP_HISTOGRAM_BUCKETS 32
+// latency histogram: 2^LATENCY_SUB_BITS linear buckets per power of two, up to ~16 s in ns
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS 256
+
+// USDT probes for perf/bpftrace, compiled out without sys/sdt.h
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE(name, ...) STAP_PROBEV(cannelloni, name, ##__VA_ARGS__)
+#else
+#define TRACE(name, ...) \
+  do {                   \
+  } while (0)
+#endif
+
+// io_uring backend sizing, buffer counts must be powers of two
+#define URING_ENTRIES 512
+#define URING_CAN_BUFFERS 1024
+#define URING_UDP_BUFFERS 512
+#define URING_UDP_BUFFER_SIZE 2048
+#define URING_SEND_SLOTS 512
+
+enum op_codes { CNL_DATA,
+                CNL_ACK,
+                CNL_NACK,
+                // frames of all channels of a gateway, each prefixed with its channel index
+                CNL_MUX_DATA,
+                // two-way time transfer, the bridge's clock is the reference
+                CNL_TIME_REQUEST,
+                CNL_TIME_REPLY };
+
+// frames carry CANFD_FRAME in len for CAN FD, like the gateway does
+static uint8_t canfd_len(const struct canfd_frame &frame) {
+  return frame.len & ~CANFD_FRAME;
+}
+
+// encoded size of the frame in the datagram
+static size_t cannelloni_frame_size(const struct canfd_frame &frame) {
+  size_t size = CANNELLONI_FRAME_BASE_SIZE;
+  if (frame.len & CANFD_FRAME) {
+    size++;
+  }
+  if (!(frame.can_id & CAN_RTR_FLAG)) {
+    size += canfd_len(frame);
+  }
+  return size;
+}
+
+static uint32_t get_u32(const uint8_t *data) {
+  return ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static uint64_t get_u64(const uint8_t *data) {
+  return ((uint64_t)get_u32(data) << 32) | get_u32(data + 4);
+}
+
+static void put_u64(uint8_t *data, uint64_t value) {
+  for (int i = 7; i >= 0; i--) {
+    data[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+// CLOCK_REALTIME like the SO_TIMESTAMPNS receive timestamps
+static uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// asks the kernel to stamp an outgoing frame with txtime (CLOCK_REALTIME ns), 0 leaves the message alone
+#define TXTIME_CONTROL_SIZE CMSG_SPACE(sizeof(uint64_t))
+static void set_txtime(struct msghdr &msg, char *control, uint64_t txtime) {
+  if (!txtime) {
+    return;
+  }
+  msg.msg_control = control;
+  msg.msg_controllen = TXTIME_CONTROL_SIZE;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(txtime));
+  memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+}
+
+// kernel receive timestamp of a message, 0 if it carries none
+static uint64_t rx_stamp(struct msghdr &msg) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+  }
+  return 0;
+}
+
+struct FrameBatch {
+  struct canfd_frame frames[FRAME_BATCH_SIZE];
+  // receive timestamp of each frame
+  uint64_t stamps[FRAME_BATCH_SIZE];
+  // frames from a gateway only: how long it held each frame before sending the datagram in ns, 0 if it doesn't say
+  uint64_t ages[FRAME_BATCH_SIZE];
+  // gateway channel of each frame, 0 unless it came multiplexed
+  uint8_t channels[FRAME_BATCH_SIZE];
+  size_t count = 0;
+
+  bool full() const {
+    return count == FRAME_BATCH_SIZE;
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+  const struct canfd_frame &operator[](size_t i) const {
+    return frames[i];
+  }
+
+  uint64_t stamp(size_t i) const {
+    return stamps[i];
+  }
+};
+
+// counter written by its runner thread only and read by the metrics server,
+// so a relaxed load and store replace a locked read-modify-write
+class Counter {
+ public:
+  void add(uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  uint64_t get() const {
+    return value.load(std::memory_order_relaxed);
+  }
+
+  void reset() {
+    value.store(0, std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<uint64_t> value{0};
+};
+
+// last value of a measurement, written and read like a Counter
+class Gauge {
+ public:
+  void set(int64_t n) {
+    value.store(n, std::memory_order_relaxed);
+  }
+
+  int64_t get() const {
+    return value.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<int64_t> value{0};
+};
+
+template <size_t N>
+class Histogram {
+ public:
+  void observe(uint64_t value) {
+    size_t bucket = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+    buckets[std::min(bucket, N - 1)].add(1);
+    sum.add(value);
+  }
+
+  static constexpr size_t size = N;
+  Counter buckets[N];
+  Counter sum;
+};
+
+// log-linear buckets in the spirit of HdrHistogram, about 12% resolution at any magnitude
+class LatencyHistogram {
+ public:
+  static constexpr uint64_t sub_buckets = 1 << LATENCY_SUB_BITS;
+
+  void observe(uint64_t ns) {
+    buckets[std::min(bucket(ns), (size_t)LATENCY_BUCKETS - 1)].add(1);
+    sum.add(ns);
+  }
+
+  static size_t bucket(uint64_t value) {
+    if (value < sub_buckets) {
+      return value;
+    }
+    unsigned exponent = 63 - __builtin_clzll(value);
+    return ((exponent - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + ((value >> (exponent - LATENCY_SUB_BITS)) & (sub_buckets - 1));
+  }
+
+  // largest value falling into the bucket
+  static uint64_t upper(size_t bucket) {
+    if (bucket < sub_buckets) {
+      return bucket;
+    }
+    unsigned exponent = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket & (sub_buckets - 1);
+    return ((sub_buckets + sub + 1) << (exponent - LATENCY_SUB_BITS)) - 1;
+  }
+
+  void reset() {
+    for (Counter &c : buckets) {
+      c.reset();
+    }
+    sum.reset();
+  }
+
+  Counter buckets[LATENCY_BUCKETS];
+  Counter sum;
+};
+
+// traffic of one endpoint, rx counts what it received and tx what it sent
+struct EndpointStats {
+  Counter rx_frames;
+  Counter rx_bytes;
+  Counter tx_frames;
+  Counter tx_bytes;
+  Counter rx_datagrams;
+  Counter tx_datagrams;
+  Counter drops;
+  Counter seq_gaps;
+  Counter faults;
+  // writes the kernel failed, their frames are in drops
+  Counter send_errors;
+  // from the kernel receiving a frame on the other endpoint until it was sent by this one
+  LatencyHistogram latency;
+  // UDP only: the gateway's clock minus ours and the round trip in ns, as of the last clock exchange,
+  // and how far off the gateway's clock was over all exchanges
+  Gauge clock_offset;
+  Gauge clock_round_trip;
+  LatencyHistogram clock_error;
+
+  void rx(const struct canfd_frame &frame) {
+    rx_frames.add(1);
+    rx_bytes.add(canfd_len(frame));
+  }
+
+  void tx(const struct canfd_frame &frame, uint64_t stamp, uint64_t now) {
+    tx(1, canfd_len(frame), &stamp, now);
+  }
+
+  // count frames with bytes of payload in all, one stamp per frame
+  void tx(size_t count, size_t bytes, const uint64_t *stamps, uint64_t now) {
+    tx_frames.add(count);
+    tx_bytes.add(bytes);
+    for (size_t i = 0; i < count; i++) {
+      if (stamps[i] && now > stamps[i]) {
+        latency.observe(now - stamps[i]);
+      }
+    }
+  }
+
+  void reset() {
+    for (Counter *c : {&rx_frames, &rx_bytes, &tx_frames, &tx_bytes, &rx_datagrams, &tx_datagrams, &drops, &seq_gaps, &faults, &send_errors}) {
+      c->reset();
+    }
+    latency.reset();
+    clock_offset.set(0);
+    clock_round_trip.set(0);
+    clock_error.reset();
+  }
+};
+
+// what a send carries, booked once the kernel reports how it went
+struct SendRecord {
+  EndpointStats *stats;
+  // name of the bridge in trace probes
+  const char *bridge;
+  // a datagram towards the gateway rather than a CAN frame
+  bool datagram;
+  uint8_t seq_no;
+  // of the first frame
+  canid_t can_id;
+  uint16_t count;
+  uint16_t bytes;
+  const uint64_t *stamps;
+};
+
+// accounts for a completed send like the epoll backend does after its write, res as returned by the syscall
+static void book_send(const SendRecord &rec, int res) {
+  if (res < 0) {
+    rec.stats->send_errors.add(1);
+    rec.stats->drops.add(rec.count);
+    TRACE(drop, rec.bridge, rec.can_id, rec.count, rec.datagram ? "udp_send" : "can_write");
+    return;
+  }
+
+  if (rec.datagram) {
+    rec.stats->tx_datagrams.add(1);
+    TRACE(datagram_send, rec.bridge, rec.seq_no, rec.count);
+  } else {
+    TRACE(can_tx, rec.bridge, rec.can_id, rec.bytes);
+  }
+  rec.stats->tx(rec.count, rec.bytes, rec.stamps, realtime_ns());
+}
+
+// counters of a bridge slot, they outlive the bridge so the metrics server never sees freed memory
+struct alignas(64) BridgeStats {
+  // seqlock around name changes, odd while the slot changes its bridge
+  std::atomic<uint32_t> version{0};
+  // bridge name packed into words, empty while the slot is unused
+  std::atomic<uint64_t> name[IF_NAMESIZE / sizeof(uint64_t)] = {};
+  EndpointStats can;
+  EndpointStats udp;
+
+  void assign(const char *bridge) {
+    version.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint64_t words[IF_NAMESIZE / sizeof(uint64_t)] = {};
+    if (bridge) {
+      snprintf(reinterpret_cast<char *>(words), sizeof(words), "%s", bridge);
+    }
+    for (size_t i = 0; i < IF_NAMESIZE / sizeof(uint64_t); i++) {
+      name[i].store(words[i], std::memory_order_relaxed);
+    }
+    can.reset();
+    udp.reset();
+
+    version.fetch_add(1, std::memory_order_release);
+  }
+};
+
+// what a full transmit queue gives up to take a new frame
+enum class OverflowPolicy {
+  DROP_OLDEST,
+  DROP_NEWEST,
+  // the new frame replaces a queued one with the same ID, only the latest value matters
+  COALESCE,
+};
+
+// bounded FIFO of frames waiting for their socket to become writable
+class TxQueue {
+ public:
+  TxQueue(OverflowPolicy policy, Counter &drops) : drops(drops), policy(policy) {}
+
+  void push(const struct canfd_frame &frame, uint64_t stamp, uint64_t age = 0) {
+    if (size() == TX_QUEUE_SIZE) {
+      drops.add(1);
+      TRACE(drop, bridge, frame.can_id, 1, "overflow");
+      switch (policy) {
+        case OverflowPolicy::DROP_NEWEST:
+          return;
+        case OverflowPolicy::COALESCE:
+          if (size_t i = find(frame.can_id); i != TX_QUEUE_SIZE) {
+            frames[i] = frame;
+            stamps[i] = stamp;
+            ages[i] = age;
+            return;
+          }
+          // no frame to replace, make room like DROP_OLDEST
+          [[fallthrough]];
+        case OverflowPolicy::DROP_OLDEST:
+          pop(1);
+          break;
+      }
+    }
+
+    stamps[tail & (TX_QUEUE_SIZE - 1)] = stamp;
+    ages[tail & (TX_QUEUE_SIZE - 1)] = age;
+    frames[tail++ & (TX_QUEUE_SIZE - 1)] = frame;
+  }
+
+  void pop(size_t n) {
+    head += n;
+  }
+
+  size_t size() const {
+    return tail - head;
+  }
+
+  bool empty() const {
+    return head == tail;
+  }
+
+  const struct canfd_frame &operator[](size_t i) const {
+    return frames[(head + i) & (TX_QUEUE_SIZE - 1)];
+  }
+
+  uint64_t stamp(size_t i) const {
+    return stamps[(head + i) & (TX_QUEUE_SIZE - 1)];
+  }
+
+  uint64_t age(size_t i) const {
+    return ages[(head + i) & (TX_QUEUE_SIZE - 1)];
+  }
+
+  // frames lost to overflows and failed writes
+  Counter &drops;
+  // name of the bridge in trace probes
+  const char *bridge = "";
+
+ private:
+  OverflowPolicy policy;
+  std::array<struct canfd_frame, TX_QUEUE_SIZE> frames;
+  std::array<uint64_t, TX_QUEUE_SIZE> stamps;
+  std::array<uint64_t, TX_QUEUE_SIZE> ages;
+  size_t head = 0;
+  size_t tail = 0;
+
+  // storage index of the newest queued frame with the ID, TX_QUEUE_SIZE if there is none
+  size_t find(canid_t id) {
+    for (size_t i = size(); i-- > 0;) {
+      size_t index = (head + i) & (TX_QUEUE_SIZE - 1);
+      if (frames[index].can_id == id) {
+        return index;
+      }
+    }
+    return TX_QUEUE_SIZE;
+  }
+};
+
+class Endpoint {
+ public:
+  Endpoint(OverflowPolicy policy, EndpointStats &stats) : tx(policy, stats.drops), stats(&stats) {}
+  Endpoint(const Endpoint &) = delete;
+  Endpoint &operator=(const Endpoint &) = delete;
+
+  Endpoint(Endpoint &&other) noexcept : tx(other.tx), stats(other.stats), fd(other.fd) {
+    other.fd = -1;
+  }
+
+  // swaps the socket only, frames queued for the old one go out through the new one
+  Endpoint &operator=(Endpoint &&other) noexcept {
+    std::swap(fd, other.fd);
+    std::swap(blocked, other.blocked);
+    std::swap(error, other.error);
+    return *this;
+  }
+
+  ~Endpoint() {
+    close();
+  }
+
+  void close() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    fd = -1;
+    error = 0;
+  }
+
+  bool is_open() const {
+    return fd >= 0;
+  }
+
+  int get_fd() const {
+    return fd;
+  }
+
+  // errno of the write that left frames in the queue
+  int get_blocked() const {
+    return blocked;
+  }
+
+  // errno that broke the socket, the endpoint has to be reopened
+  int get_error() const {
+    return error;
+  }
+
+  // errors after which the socket won't recover, e.g. its interface went down
+  static bool is_fault(int err) {
+    return err == ENETDOWN || err == ENODEV || err == ENXIO || err == EADDRNOTAVAIL || err == EBADF;
+  }
+
+  TxQueue tx;
+  EndpointStats *stats;
+
+ protected:
+  int fd = -1;
+  int blocked = 0;
+  int error = 0;
+
+  static bool would_block(int err) {
+    // ENOBUFS: the CAN interface's TX queue is full
+    return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+  }
+
+  // closes the half-opened socket after a failed setup step
+  bool fail(const char *what) {
+    perror(what);
+    close();
+    return false;
+  }
+};
+
+// frames the kernel passes to a bridge's CAN socket, no rules pass all data frames
+struct CANFilter {
+  struct can_filter rules[CAN_FILTER_MAX];
+  uint8_t count;
+  can_err_mask_t err_mask;
+
+  bool operator==(const CANFilter &other) const {
+    return count == other.count && err_mask == other.err_mask && memcmp(rules, other.rules, count * sizeof(rules[0])) == 0;
+  }
+};
+
+// parses candump(1) style filters: <id>:<mask> matches, <id>~<mask> inverts, #<mask> selects
+// error frames, all hex and separated by commas, an 8 digit ID is an extended one
+static bool parse_filter(const char *spec, CANFilter &filter) {
+  filter = {};
+  char *end;
+  for (const char *p = spec; *p; p = end) {
+    if (*p == '#') {
+      filter.err_mask = strtoul(p + 1, &end, 16);
+      if (end == p + 1) {
+        return false;
+      }
+    } else {
+      if (filter.count == CAN_FILTER_MAX) {
+        return false;
+      }
+      struct can_filter &rule = filter.rules[filter.count++];
+      rule.can_id = strtoul(p, &end, 16);
+      if (end == p || (*end != ':' && *end != '~')) {
+        return false;
+      }
+      if (end - p == 8) {
+        rule.can_id |= CAN_EFF_FLAG;
+      }
+      if (*end == '~') {
+        rule.can_id |= CAN_INV_FILTER;
+      }
+      p = end + 1;
+      rule.can_mask = strtoul(p, &end, 16);
+      if (end == p) {
+        return false;
+      }
+    }
+    if (*end != ',' && *end != '\0') {
+      return false;
+    }
+    if (*end == ',') {
+      end++;
+    }
+  }
+  return true;
+}
+
+// whether the interface's IFLA_INFO_KIND is vcan, asked with a one-off RTM_GETLINK
+static bool is_vcan(int ifindex) {
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct {
+    struct nlmsghdr nlh;
+    struct ifinfomsg ifi;
+  } request = {};
+  request.nlh.nlmsg_len = sizeof(request);
+  request.nlh.nlmsg_type = RTM_GETLINK;
+  request.nlh.nlmsg_flags = NLM_F_REQUEST;
+  request.ifi.ifi_family = AF_UNSPEC;
+  request.ifi.ifi_index = ifindex;
+
+  uint8_t buffer[8192];
+  ssize_t n = -1;
+  if (send(fd, &request, sizeof(request), 0) == (ssize_t)sizeof(request)) {
+    n = recv(fd, buffer, sizeof(buffer), 0);
+  }
+  close(fd);
+
+  bool vcan = false;
+  size_t len = n < 0 ? 0 : n;
+  for (struct nlmsghdr *nlh = (struct nlmsghdr *)buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+    if (nlh->nlmsg_type != RTM_NEWLINK) {
+      continue;
+    }
+    int attrs_len = IFLA_PAYLOAD(nlh);
+    for (struct rtattr *attr = IFLA_RTA((struct ifinfomsg *)NLMSG_DATA(nlh)); RTA_OK(attr, attrs_len); attr = RTA_NEXT(attr, attrs_len)) {
+      if (attr->rta_type != IFLA_LINKINFO) {
+        continue;
+      }
+      int info_len = RTA_PAYLOAD(attr);
+      for (struct rtattr *info = (struct rtattr *)RTA_DATA(attr); RTA_OK(info, info_len); info = RTA_NEXT(info, info_len)) {
+        if (info->rta_type == IFLA_INFO_KIND) {
+          vcan = RTA_PAYLOAD(info) == sizeof("vcan") && memcmp(RTA_DATA(info), "vcan", sizeof("vcan")) == 0;
+        }
+      }
+    }
+  }
+  return vcan;
+}
+
+class CANEndpoint : public Endpoint {
+ public:
+  CANEndpoint(const char *if_name, const CANFilter &filter, bool fd_frames, OverflowPolicy policy, EndpointStats &stats) : Endpoint(policy, stats), filter(filter), fd_frames(fd_frames) {
+    snprintf(name, sizeof(name), "%s", if_name);
+  }
+
+  // (re)binds to the interface, false leaves the endpoint closed
+  bool open() {
+    fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
+    if (fd == -1) {
+      return fail("socket");
+    }
+
+    struct ifreq ifr;
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", name);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+      return fail(name);
+    }
+
+    if (!apply_fd_frames()) {
+      return fail("setsockopt(SOL_CAN_RAW, CAN_RAW_FD_FRAMES)");
+    }
+
+    int enabled = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enabled, sizeof(enabled)) != 0) {
+      return fail("setsockopt(SOL_SOCKET, SO_TIMESTAMPNS)");
+    }
+
+    // lets written frames keep the time they reached the gateway or the bridge as their receive timestamp,
+    // needs CAP_NET_ADMIN and Linux 5.10, without them readers see the time of the write
+    // vcan only: on a real controller under an ETF or fq qdisc the txtime is a send deadline, and past ones get dropped
+    stamping = false;
+    if (is_vcan(ifr.ifr_ifindex)) {
+      struct sock_txtime config = {CLOCK_REALTIME, 0};
+      stamping = setsockopt(fd, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == 0;
+    }
+
+    // filtered before binding, no unwanted frame gets queued in between
+    if (!apply_filter()) {
+      return fail("setsockopt(SOL_CAN_RAW, CAN_RAW_FILTER)");
+    }
+
+    struct sockaddr_can addr;
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      return fail("bind");
+    }
+    return true;
+  }
+
+  // fills the batch with frames pending on the socket, flush is called once it is done
+  template <typename Flush>
+  void read(FrameBatch &batch, Flush &&flush) {
+    while (!batch.full()) {
+      struct canfd_frame &frame = batch.frames[batch.count];
+      struct iovec iov = {&frame, sizeof(frame)};
+      char control[CMSG_SPACE(sizeof(struct timespec))];
+      struct msghdr msg = {};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ssize_t n = recvmsg(fd, &msg, 0);
+      if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          error = errno;
+        }
+        break;
+      }
+
+      if (!decode(frame, n)) {
+        fprintf(stderr, "%s: unexpected CAN frame size %zd\n", name, n);
+        continue;
+      }
+
+      stats->rx(frame);
+      TRACE(can_rx, tx.bridge, frame.can_id, canfd_len(frame));
+      batch.stamps[batch.count] = rx_stamp(msg);
+      batch.count++;
+    }
+
+    flush(batch);
+  }
+
+  void write(const FrameBatch &batch) {
+    for (size_t i = 0; i < batch.count; i++) {
+      tx.push(batch.frames[i], batch.stamps[i], batch.ages[i]);
+    }
+    flush();
+  }
+
+  // writes queued frames until the socket pushes back, returns whether the queue is empty
+  bool flush() {
+    while (!tx.empty() && fd >= 0) {
+      struct canfd_frame frame = tx[0];
+      size_t size = encode(frame);
+
+      struct iovec iov = {&frame, size};
+      char control[TXTIME_CONTROL_SIZE];
+      struct msghdr msg = {};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      set_txtime(msg, control, txtime(tx.stamp(0), tx.age(0)));
+      ssize_t n = sendmsg(fd, &msg, 0);
+      if (n < 0 && would_block(errno)) {
+        blocked = errno;
+        return false;
+      }
+      if (n < 0 && is_fault(errno)) {
+        // kept for the reopened socket
+        error = errno;
+        return false;
+      }
+      if (n != (ssize_t)size) {
+        perror("CAN write failed");
+        stats->send_errors.add(1);
+        tx.drops.add(1);
+        TRACE(drop, tx.bridge, tx[0].can_id, 1, "can_write");
+      } else {
+        stats->tx(tx[0], tx.stamp(0), realtime_ns());
+        TRACE(can_tx, tx.bridge, tx[0].can_id, canfd_len(tx[0]));
+      }
+      tx.pop(1);
+    }
+    return tx.empty();
+  }
+
+  // marks FD frames in a frame of n bytes read from the socket
+  static bool decode(struct canfd_frame &frame, ssize_t n) {
+    if (n == (ssize_t)CANFD_MTU) {
+      frame.len |= CANFD_FRAME;
+    } else if (n == (ssize_t)CAN_MTU) {
+      frame.flags = 0;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // turns the frame into its socket representation and returns its size
+  static size_t encode(struct canfd_frame &frame) {
+    if (frame.len & CANFD_FRAME) {
+      frame.len = canfd_len(frame);
+      return CANFD_MTU;
+    }
+    return CAN_MTU;
+  }
+
+  // replaces the filter, an open socket takes it over right away
+  void set_filter(const CANFilter &filter) {
+    this->filter = filter;
+    if (fd >= 0 && !apply_filter()) {
+      perror("setsockopt(SOL_CAN_RAW, CAN_RAW_FILTER)");
+    }
+  }
+
+  const CANFilter &get_filter() const {
+    return filter;
+  }
+
+  // whether FD frames are read from the bus, only for gateways whose controllers send them
+  void set_fd_frames(bool fd_frames) {
+    this->fd_frames = fd_frames;
+    if (fd >= 0 && !apply_fd_frames()) {
+      perror("setsockopt(SOL_CAN_RAW, CAN_RAW_FD_FRAMES)");
+    }
+  }
+
+  bool get_fd_frames() const {
+    return fd_frames;
+  }
+
+  // the receive timestamp a frame is written with, 0 for the time of the write
+  // moved back by how long the frame waited on the gateway, which leaves out the network only
+  uint64_t txtime(uint64_t stamp, uint64_t age) const {
+    if (!stamping) {
+      return 0;
+    }
+    return stamp > age ? stamp - age : stamp;
+  }
+
+ private:
+  char name[IF_NAMESIZE];
+  CANFilter filter;
+  bool fd_frames;
+  bool stamping = false;
+
+  // without CAN_RAW_FD_FRAMES the kernel keeps FD frames from the socket
+  bool apply_fd_frames() {
+    int enabled = fd_frames;
+    return setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enabled, sizeof(enabled)) == 0;
+  }
+
+  bool apply_filter() {
+    // the kernel's default: a single rule matching everything
+    static const struct can_filter pass_all = {0, 0};
+    const struct can_filter *rules = filter.count ? filter.rules : &pass_all;
+    socklen_t size = (filter.count ? filter.count : 1) * sizeof(struct can_filter);
+    return setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, rules, size) == 0 &&
+           setsockopt(fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &filter.err_mask, sizeof(filter.err_mask)) == 0;
+  }
+};
+
+// a gateway channel whose frames arrive multiplexed with its siblings' on a shared port, port 0 when not
+struct Mux {
+  uint16_t port;
+  uint8_t channel;
+
+  bool operator==(const Mux &other) const {
+    return port == other.port && channel == other.channel;
+  }
+};
+
+// how datagrams travel between gateway and bridge
+enum class Transport { UDP,
+                       // no IP/UDP headers, the gateway has to be on the link of its address' scope
+                       ETH };
+
+class UDPEndpoint : public Endpoint {
+ public:
+  UDPEndpoint(const char *addr, uint16_t port, const Mux &mux, Transport transport, OverflowPolicy policy, EndpointStats &stats)
+      : Endpoint(policy, stats), port(port), mux(mux), transport(transport) {
+    snprintf(this->addr, sizeof(this->addr), "%s", addr);
+  }
+
+  // resolves the gateway and joins its group, false leaves the endpoint closed
+  bool open() {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo *res = nullptr;
+    int err = getaddrinfo(addr, service, &hints, &res);
+    if (err != 0) {
+      // the scope interface of a link-local address may not exist yet
+      fprintf(stderr, "getaddrinfo %s: %s\n", addr, gai_strerror(err));
+      return false;
+    }
+    if (sizeof(dst) != res->ai_addrlen) {
+      fprintf(stderr, "Wrong address size %zu != %u\n", sizeof(dst), res->ai_addrlen);
+      freeaddrinfo(res);
+      return false;
+    }
+    memcpy(&dst, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+
+    if (transport == Transport::ETH) {
+      return open_link();
+    }
+
+    fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+      return fail("socket creation failed");
+    }
+
+    int enabled = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) != 0) {
+      return fail("setsockopt(SOL_SOCKET, SO_REUSEADDR)");
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enabled, sizeof(enabled)) != 0) {
+      return fail("setsockopt(SOL_SOCKET, SO_TIMESTAMPNS)");
+    }
+
+    // of a multiplexing gateway's channels only the reader binds the shared port, the others get their clock replies
+    struct sockaddr_in6 server_addr = dst;
+    server_addr.sin6_addr.s6_addr16[0] = htons(0xff02);
+    server_addr.sin6_port = htons(rx_port());
+    if (bind(fd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+      return fail("bind failed");
+    }
+
+    struct ipv6_mreq mreq = {};
+    mreq.ipv6mr_multiaddr = server_addr.sin6_addr;
+    mreq.ipv6mr_interface = server_addr.sin6_scope_id;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) != 0) {
+      return fail("setsockopt(PPROTO_IPV6, IPV6_JOIN_GROUP)");
+    }
+    return true;
+  }
+
+  // decodes one datagram into the batch, flush is called whenever the batch fills up
+  template <typename Flush>
+  void read(FrameBatch &batch, Flush &&flush) {
+    static thread_local uint8_t buffer[65536];
+    struct iovec iov = {buffer, sizeof(buffer)};
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct sockaddr_storage src;
+    struct msghdr msg = {};
+    msg.msg_name = &src;
+    msg.msg_namelen = sizeof(src);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        error = errno;
+      }
+      return;
+    }
+
+    receive(buffer, n, rx_stamp(msg), (const struct sockaddr *)&src, batch, flush);
+  }
+
+  // accounts for a received datagram and decodes it, its frames share the datagram's timestamp
+  template <typename Flush>
+  void receive(const uint8_t *buffer, size_t n, uint64_t stamp, const struct sockaddr *src, FrameBatch &batch, Flush &&flush) {
+    if (transport == Transport::ETH) {
+      // clock replies come back on the channel's port even when data comes on the mux port
+      uint16_t to = n < CNL_ETH_PORT_SIZE ? 0 : (buffer[0] << 8) | buffer[1];
+      if (!to || (to != rx_port() && to != port)) {
+        return;
+      }
+      learn(src);
+      buffer += CNL_ETH_PORT_SIZE;
+      n -= CNL_ETH_PORT_SIZE;
+    }
+
+    if (n >= CNL_TIME_REPLY_SIZE && buffer[0] == CANNELLONI_FRAME_VERSION && buffer[1] == CNL_TIME_REPLY) {
+      time_reply(buffer, stamp ? stamp : realtime_ns());
+      return;
+    }
+
+    stats->rx_datagrams.add(1);
+    if (n >= CANNELLONI_DATA_PACKET_BASE_SIZE && buffer[0] == CANNELLONI_FRAME_VERSION && (buffer[1] & ~CNL_OP_TIMESTAMPS) == (mux.port ? CNL_MUX_DATA : CNL_DATA)) {
+      if (rx_seq >= 0) {
+        stats->seq_gaps.add((uint8_t)(buffer[2] - rx_seq - 1));
+      }
+      rx_seq = buffer[2];
+    }
+    TRACE(datagram_rx, tx.bridge, rx_seq, n);
+
+    decode(buffer, n, mux, demuxes(), batch, [&](FrameBatch &frames) {
+      for (size_t i = 0; i < frames.count; i++) {
+        frames.stamps[i] = stamp;
+        // other channels' frames are accounted to their bridges when they get them
+        if (frames.channels[i] == mux.channel) {
+          stats->rx(frames.frames[i]);
+          TRACE(frame_decode, tx.bridge, frames.frames[i].can_id, canfd_len(frames.frames[i]));
+        }
+      }
+      flush(frames);
+    });
+  }
+
+  void write(const FrameBatch &batch) {
+    for (size_t i = 0; i < batch.count; i++) {
+      tx.push(batch.frames[i], batch.stamps[i]);
+    }
+    flush();
+  }
+
+  // sends queued frames until the socket pushes back, returns whether the queue is empty
+  bool flush() {
+    while (!tx.empty() && fd >= 0) {
+      uint8_t buffer[CNL_ETH_PORT_SIZE + CANNELLONI_MAX_DATAGRAM];
+      size_t len;
+      size_t count = pack(tx, 0, buffer, len);
+
+      ssize_t n = sendto(fd, buffer, len, 0, get_dst(), get_dst_len());
+      if (n < 0 && would_block(errno)) {
+        blocked = errno;
+        return false;
+      }
+      if (n < 0 && is_fault(errno)) {
+        error = errno;
+        return false;
+      }
+      if (n != (ssize_t)len) {
+        perror("UDP sendto failed");
+        stats->send_errors.add(1);
+        tx.drops.add(count);
+        TRACE(drop, tx.bridge, tx[0].can_id, count, "udp_send");
+      } else {
+        sent(tx, 0, count);
+      }
+      seq_no++;
+      tx.pop(count);
+    }
+    return tx.empty();
+  }
+
+  // starts a clock exchange, also handing the gateway the times of the previous one to correct its clock
+  void request_time() {
+    uint8_t buffer[CNL_ETH_PORT_SIZE + CNL_TIME_REQUEST_SIZE];
+    size_t head = put_port(buffer);
+    uint8_t *request = buffer + head;
+    request[0] = CANNELLONI_FRAME_VERSION;
+    request[1] = CNL_TIME_REQUEST;
+    request[2] = 0;
+    request[3] = 0;
+    request[4] = 0;
+    put_u64(&request[CANNELLONI_DATA_PACKET_BASE_SIZE + 8], last_t1);
+    put_u64(&request[CANNELLONI_DATA_PACKET_BASE_SIZE + 16], last_t4);
+
+    pending_t1 = realtime_ns();
+    put_u64(&request[CANNELLONI_DATA_PACKET_BASE_SIZE], pending_t1);
+    if (sendto(fd, buffer, head + CNL_TIME_REQUEST_SIZE, 0, get_dst(), get_dst_len()) < 0) {
+      pending_t1 = 0;
+    }
+  }
+
+  // decodes the frames of mux's channel only when the gateway multiplexes, or of all its channels for the mux reader
+  // ages tell how many ns before the datagram was sent the gateway received each frame, 0 if it doesn't say
+  template <typename Flush>
+  static void decode(const uint8_t *buffer, size_t n, const Mux &mux, bool all_channels, FrameBatch &batch, Flush &&flush) {
+    if (n < CANNELLONI_DATA_PACKET_BASE_SIZE || buffer[0] != CANNELLONI_FRAME_VERSION || (buffer[1] & ~CNL_OP_TIMESTAMPS) != (mux.port ? CNL_MUX_DATA : CNL_DATA)) {
+      fprintf(stderr, "invalid cannelloni packet\n");
+      return;
+    }
+
+    uint16_t count = (buffer[3] << 8) | buffer[4];
+    size_t pos = CANNELLONI_DATA_PACKET_BASE_SIZE;
+    size_t stamp_size = 0;
+    uint32_t sent = 0;
+    if (buffer[1] & CNL_OP_TIMESTAMPS) {
+      if (n < pos + CNL_TIMESTAMP_SIZE) {
+        fprintf(stderr, "invalid cannelloni packet\n");
+        return;
+      }
+      sent = get_u32(&buffer[pos]);
+      pos += CNL_TIMESTAMP_SIZE;
+      stamp_size = CNL_TIMESTAMP_SIZE;
+    }
+
+    size_t channel_size = mux.port ? 1 : 0;
+    while (count > 0 && pos + channel_size + stamp_size + CANNELLONI_FRAME_BASE_SIZE <= n) {
+      uint8_t channel = mux.port ? buffer[pos++] : 0;
+      // the gateway's clock wraps, the difference doesn't
+      uint64_t age = stamp_size ? (uint32_t)(sent - get_u32(&buffer[pos])) * 1000ull : 0;
+      pos += stamp_size;
+      uint32_t id = get_u32(&buffer[pos]);
+      uint8_t len = buffer[pos + 4];
+      pos += CANNELLONI_FRAME_BASE_SIZE;
+
+      if (batch.full()) {
+        flush(batch);
+        batch.count = 0;
+      }
+
+      batch.ages[batch.count] = age;
+      batch.channels[batch.count] = channel;
+      struct canfd_frame &frame = batch.frames[batch.count];
+      frame.can_id = id;
+      frame.len = len;
+      frame.flags = 0;
+      if (len & CANFD_FRAME) {
+        if (pos >= n) {
+          break;
+        }
+        frame.flags = buffer[pos++];
+      }
+
+      size_t max_len = (len & CANFD_FRAME) ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+      if (canfd_len(frame) > max_len) {
+        fprintf(stderr, "invalid frame length %d\n", canfd_len(frame));
+        break;
+      }
+
+      // RTR frames have no data section although they have a dlc
+      if (!(id & CAN_RTR_FLAG)) {
+        if (pos + canfd_len(frame) > n) {
+          break;
+        }
+        memcpy(frame.data, &buffer[pos], canfd_len(frame));
+        pos += canfd_len(frame);
+      }
+
+      if (all_channels || channel == mux.channel) {
+        batch.count++;
+      }
+      count--;
+    }
+
+    if (count != 0) {
+      fprintf(stderr, "frames %d missing\n", count);
+    }
+
+    flush(batch);
+  }
+
+  // packs the batch into as few datagrams as possible, send is called for each of them
+  template <typename Send>
+  void encode(const FrameBatch &batch, Send &&send) {
+    uint8_t tx[CNL_ETH_PORT_SIZE + CANNELLONI_MAX_DATAGRAM];
+    for (size_t i = 0; i < batch.count;) {
+      size_t len;
+      size_t count = pack(batch, i, tx, len);
+      send(tx, len, i, count);
+      seq_no++;
+      i += count;
+    }
+  }
+
+  // the gateway's address, its MAC once learned for raw Ethernet
+  const struct sockaddr *get_dst() const {
+    return transport == Transport::ETH ? (const struct sockaddr *)&link_dst : (const struct sockaddr *)&dst;
+  }
+
+  socklen_t get_dst_len() const {
+    return transport == Transport::ETH ? sizeof(link_dst) : sizeof(dst);
+  }
+
+  // a multiplexing gateway's datagrams are read by one of its channels' endpoints, set before open()
+  void set_reader(bool reader) {
+    this->reader = reader;
+  }
+
+  // whether this endpoint takes the gateway's mux port and decodes the frames of all its channels
+  bool demuxes() const {
+    return mux.port && reader;
+  }
+
+  // describes a datagram holding count frames from first on for book_send()
+  SendRecord record(const FrameBatch &frames, size_t first, size_t count) const {
+    size_t bytes = 0;
+    for (size_t i = first; i < first + count; i++) {
+      bytes += canfd_len(frames[i]);
+    }
+    return {stats, tx.bridge, true, seq_no, frames[first].can_id, (uint16_t)count, (uint16_t)bytes, &frames.stamps[first]};
+  }
+
+  // accounts for a datagram holding count frames from first on
+  template <typename Frames>
+  void sent(const Frames &frames, size_t first, size_t count) {
+    uint64_t now = realtime_ns();
+    stats->tx_datagrams.add(1);
+    TRACE(datagram_send, tx.bridge, seq_no, count);
+    for (size_t i = first; i < first + count; i++) {
+      stats->tx(frames[i], frames.stamp(i), now);
+    }
+  }
+
+ private:
+  char addr[AVAHI_ADDRESS_STR_MAX + IF_NAMESIZE + 1];
+  uint16_t port;
+  Mux mux;
+  Transport transport;
+  bool reader = true;
+  struct sockaddr_in6 dst = {};
+  // raw Ethernet: broadcast until the first datagram tells the gateway's MAC
+  struct sockaddr_ll link_dst = {};
+  uint8_t seq_no = 0;
+  // clock exchange: send time of the request in flight, 0 if none, and our send and receive times of the last one
+  uint64_t pending_t1 = 0;
+  uint64_t last_t1 = 0;
+  uint64_t last_t4 = 0;
+  // sequence number of the last received datagram, -1 before the first one
+  int rx_seq = -1;
+
+  // fills one datagram with the frames from first on, returns how many of them fit
+  template <typename Frames>
+  size_t pack(const Frames &frames, size_t first, uint8_t *buffer, size_t &len) {
+    size_t head = put_port(buffer);
+    uint8_t *tx = buffer + head;
+    size_t pos = CANNELLONI_DATA_PACKET_BASE_SIZE;
+    uint16_t count = 0;
+
+    for (size_t i = first; i < frames.size(); i++) {
+      const struct canfd_frame &frame = frames[i];
+      if (pos + cannelloni_frame_size(frame) > CANNELLONI_MAX_DATAGRAM) {
+        break;
+      }
+
+      uint32_t canid = htonl(frame.can_id);
+      memcpy(&tx[pos], &canid, 4);
+      pos += 4;
+
+      tx[pos++] = frame.len;
+      if (frame.len & CANFD_FRAME) {
+        tx[pos++] = frame.flags;
+      }
+
+      if (!(frame.can_id & CAN_RTR_FLAG)) {
+        memcpy(&tx[pos], frame.data, canfd_len(frame));
+        pos += canfd_len(frame);
+      }
+      count++;
+    }
+
+    tx[0] = CANNELLONI_FRAME_VERSION;
+    tx[1] = CNL_DATA;
+    tx[2] = seq_no;
+    tx[3] = count >> 8;
+    tx[4] = count & 0xff;
+    len = head + pos;
+    TRACE(datagram_encode, this->tx.bridge, seq_no, count, len);
+    return count;
+  }
+
+  // raw Ethernet datagrams start with the port telling the gateway the channel, returns its size
+  size_t put_port(uint8_t *buffer) const {
+    if (transport != Transport::ETH) {
+      return 0;
+    }
+    buffer[0] = port >> 8;
+    buffer[1] = port & 0xff;
+    return CNL_ETH_PORT_SIZE;
+  }
+
+  // NTP's offset and round trip from t1 (request sent) to t4 (reply received), t2 and t3 on the gateway
+  void time_reply(const uint8_t *reply, uint64_t t4) {
+    const uint8_t *times = reply + CANNELLONI_DATA_PACKET_BASE_SIZE;
+    uint64_t t1 = get_u64(times);
+    if (!pending_t1 || t1 != pending_t1) {
+      // a sibling's on a shared port, or one we gave up on
+      return;
+    }
+    pending_t1 = 0;
+    last_t1 = t1;
+    last_t4 = t4;
+
+    // until the gateway took one exchange its clock is not ours
+    bool synced = times[24];
+    if (!synced) {
+      return;
+    }
+    int64_t t2 = get_u64(times + 8);
+    int64_t t3 = get_u64(times + 16);
+    int64_t offset = ((t2 - (int64_t)t1) + (t3 - (int64_t)t4)) / 2;
+    int64_t round_trip = ((int64_t)t4 - (int64_t)t1) - (t3 - t2);
+    stats->clock_offset.set(offset);
+    stats->clock_round_trip.set(round_trip);
+    stats->clock_error.observe(offset < 0 ? -offset : offset);
+    TRACE(clock_sync, tx.bridge, offset, round_trip);
+  }
+
+  // port of the datagrams meant for this endpoint
+  uint16_t rx_port() const {
+    return demuxes() ? mux.port : port;
+  }
+
+  // packet socket for the gateway's EtherType on the interface of the address' scope
+  bool open_link() {
+    fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+      return fail("socket creation failed");
+    }
+
+    // leaves the datagrams of other channels and gateways in the kernel
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, rx_port(), 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0) {
+      return fail("setsockopt(SOL_SOCKET, SO_ATTACH_FILTER)");
+    }
+
+    int enabled = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enabled, sizeof(enabled)) != 0) {
+      return fail("setsockopt(SOL_SOCKET, SO_TIMESTAMPNS)");
+    }
+
+    link_dst = {};
+    link_dst.sll_family = AF_PACKET;
+    link_dst.sll_protocol = htons(CNL_ETHERTYPE);
+    link_dst.sll_ifindex = dst.sin6_scope_id;
+    link_dst.sll_halen = ETH_ALEN;
+    memset(link_dst.sll_addr, 0xff, ETH_ALEN);
+    if (bind(fd, (const struct sockaddr *)&link_dst, sizeof(link_dst)) < 0) {
+      return fail("bind failed");
+    }
+
+    // the gateway sends to the MAC of the IPv6 group the UDP transport joins
+    struct packet_mreq mreq = {};
+    mreq.mr_ifindex = dst.sin6_scope_id;
+    mreq.mr_type = PACKET_MR_MULTICAST;
+    mreq.mr_alen = ETH_ALEN;
+    mreq.mr_address[0] = 0x33;
+    mreq.mr_address[1] = 0x33;
+    memcpy(&mreq.mr_address[2], &dst.sin6_addr.s6_addr[12], 4);
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+      return fail("setsockopt(SOL_PACKET, PACKET_ADD_MEMBERSHIP)");
+    }
+    return true;
+  }
+
+  // sends to the gateway's MAC instead of broadcast once a datagram came from it
+  void learn(const struct sockaddr *src) {
+    const struct sockaddr_ll *ll = (const struct sockaddr_ll *)src;
+    if (src && src->sa_family == AF_PACKET && ll->sll_halen == ETH_ALEN) {
+      memcpy(link_dst.sll_addr, ll->sll_addr, ETH_ALEN);
+    }
+  }
+};
+
+struct alignas(64) Bridge {
+  Bridge(const char *canif_name, const char *addr, uint16_t port, const Mux &mux, Transport transport, const CANFilter &filter, bool fd_frames, OverflowPolicy policy, BridgeStats &stats)
+      : can(canif_name, filter, fd_frames, policy, stats.can), udp(addr, port, mux, transport, policy, stats.udp), port(port), mux(mux), transport(transport), stats(&stats) {
+    snprintf(name, sizeof(name), "%s", canif_name);
+    can.tx.bridge = udp.tx.bridge = name;
+    snprintf(this->addr, sizeof(this->addr), "%s", addr);
+  }
+
+  // whether both bridges take channels multiplexed on the same port of one gateway
+  bool shares_mux(const Bridge &other) const {
+    return mux.port && other.mux.port == mux.port && other.transport == transport && strcmp(other.addr, addr) == 0;
+  }
+
+  CANEndpoint can;
+  UDPEndpoint udp;
+  char name[IF_NAMESIZE];
+  char addr[AVAHI_ADDRESS_STR_MAX + IF_NAMESIZE + 1];
+  uint16_t port;
+  Mux mux;
+  Transport transport;
+  BridgeStats *stats;
+
+  // epoll backend: registered events, both backends: drops already reported per endpoint
+  uint32_t events[2] = {EPOLLIN, EPOLLIN};
+  uint64_t reported_drops[2] = {0, 0};
+
+  // closed endpoints: next reopen attempt on the monotonic clock (0 while open) and the current backoff
+  uint64_t reopen_at[2] = {0, 0};
+  uint32_t backoff_ms[2] = {0, 0};
+
+  // io_uring backend: armed multishot receives per endpoint and CAN sends in flight, freed once all ended
+  uint8_t armed[2] = {0, 0};
+  uint32_t sending = 0;
+  bool dying = false;
+
+  bool idle() const {
+    return !armed[0] && !armed[1] && !sending;
+  }
+};
+
+// epoll events and io_uring completions carry an object pointer tagged with its kind
+enum EventTag : uintptr_t {
+  EVENT_CAN,
+  EVENT_UDP,
+  EVENT_COMMAND,
+  EVENT_AVAHI_WATCH,
+  EVENT_AVAHI_TIMEOUT,
+  EVENT_EPOLL,
+  EVENT_SEND,
+  EVENT_CANCEL,
+  EVENT_RETRY,
+  EVENT_REOPEN,
+  EVENT_LINK,
+  EVENT_CLOCK,
+  EVENT_TAG_MASK = 0xf,
+};
+
+static_assert(alignof(Bridge) > EVENT_TAG_MASK, "tag does not fit into bridge pointers");
+
+static uint64_t event_tag(const void *ptr, EventTag tag) {
+  return reinterpret_cast<uintptr_t>(ptr) | tag;
+}
+
+static const char *side_name(EventTag side) {
+  return side == EVENT_CAN ? "CAN" : "UDP";
+}
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+// minimal io_uring binding on top of the raw kernel ABI
+class Uring {
+ public:
+  Uring(unsigned entries) {
+    struct io_uring_params params = {};
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+      // kernels before 6.0 do not know the hints
+      params = {};
+      fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (fd < 0) {
+      perror("io_uring_setup");
+      exit(1);
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+      fprintf(stderr, "io_uring without IORING_FEAT_SINGLE_MMAP is not supported\n");
+      exit(1);
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size = std::max(sq_size, cq_size);
+    ring = static_cast<uint8_t *>(mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING));
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+      perror("mmap io_uring");
+      exit(1);
+    }
+
+    sq_head = reinterpret_cast<unsigned *>(ring + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(ring + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    cq_head = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(ring + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(ring + params.cq_off.cqes);
+
+    // SQEs are always consumed in ring order
+    unsigned *sq_array = reinterpret_cast<unsigned *>(ring + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; i++) {
+      sq_array[i] = i;
+    }
+    sqe_tail = *sq_tail;
+  }
+
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  ~Uring() {
+    munmap(sqes, sqes_size);
+    munmap(ring, ring_size);
+    close(fd);
+  }
+
+  int get_fd() const {
+    return fd;
+  }
+
+  struct io_uring_sqe *get_sqe() {
+    if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+      submit(0);
+    }
+
+    struct io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe_tail++;
+    return sqe;
+  }
+
+  // hands all queued SQEs to the kernel in one syscall, optionally waiting for completions
+  void submit(unsigned wait_nr) {
+    unsigned to_submit = sqe_tail - *sq_tail;
+    if (!to_submit && !wait_nr) {
+      return;
+    }
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0) {
+      if (errno != EINTR) {
+        perror("io_uring_enter");
+        exit(1);
+      }
+    }
+  }
+
+  template <typename F>
+  void for_each_cqe(F &&f) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      f(cqes[head & cq_mask]);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+ private:
+  int fd;
+  uint8_t *ring;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sqe_tail;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+// registered ring of equally sized receive buffers the kernel picks from
+class BufferRing {
+ public:
+  BufferRing(Uring &uring, uint16_t group, unsigned count, size_t size) : group(group), count(count), size(size) {
+    ring_size = count * sizeof(struct io_uring_buf);
+    ring = static_cast<struct io_uring_buf_ring *>(mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+    if (ring == MAP_FAILED) {
+      perror("mmap buffer ring");
+      exit(1);
+    }
+    buffers = std::make_unique<uint8_t[]>(count * size);
+
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = reinterpret_cast<uintptr_t>(ring);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, uring.get_fd(), IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+      perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+      exit(1);
+    }
+
+    for (unsigned bid = 0; bid < count; bid++) {
+      recycle(bid);
+    }
+    publish();
+  }
+
+  BufferRing(const BufferRing &) = delete;
+  BufferRing &operator=(const BufferRing &) = delete;
+
+  ~BufferRing() {
+    munmap(ring, ring_size);
+  }
+
+  uint16_t get_group() const {
+    return group;
+  }
+
+  uint8_t *get(uint16_t bid) {
+    return &buffers[bid * size];
+  }
+
+  // hands the buffer back to the kernel with the next publish()
+  void recycle(uint16_t bid) {
+    // not ring->bufs, C++ gives the empty struct in __DECLARE_FLEX_ARRAY a size
+    struct io_uring_buf *buf = &reinterpret_cast<struct io_uring_buf *>(ring)[tail & (count - 1)];
+    buf->addr = reinterpret_cast<uintptr_t>(get(bid));
+    buf->len = size;
+    buf->bid = bid;
+    tail++;
+  }
+
+  void publish() {
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+
+ private:
+  uint16_t group;
+  unsigned count;
+  size_t size;
+  struct io_uring_buf_ring *ring;
+  size_t ring_size;
+  std::unique_ptr<uint8_t[]> buffers;
+  uint16_t tail = 0;
+};
+
+// buffer of a send in flight, owned by the kernel until its completion
+struct alignas(16) SendSlot {
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_storage dst;
+  char control[TXTIME_CONTROL_SIZE];
+  SendSlot *next;
+  size_t len;
+  // copy of the record passed to send(), the bridge may be gone by the completion of a datagram
+  SendRecord record;
+  // bridge of a CAN frame, which takes the frame back into its queue when the send would block
+  Bridge *owner;
+  uint64_t age;
+  char bridge[IF_NAMESIZE];
+  uint64_t stamps[FRAME_BATCH_SIZE];
+  uint8_t data[CNL_ETH_PORT_SIZE + CANNELLONI_MAX_DATAGRAM];
+};
+
+// io_uring state of a runner, data sockets never enter the epoll set with it
+class UringBackend {
+ public:
+  // receive buffers start with the recvmsg header, the source address and the timestamp control message
+  // the name fits the gateway's IPv6 and packet socket addresses
+  static constexpr size_t recv_name = sizeof(struct sockaddr_in6);
+  static constexpr size_t recv_header = sizeof(struct io_uring_recvmsg_out) + recv_name + CMSG_SPACE(sizeof(struct timespec));
+
+  UringBackend()
+      : uring(URING_ENTRIES),
+        can_buffers(uring, 0, URING_CAN_BUFFERS, recv_header + sizeof(struct canfd_frame)),
+        udp_buffers(uring, 1, URING_UDP_BUFFERS, URING_UDP_BUFFER_SIZE),
+        slots(URING_SEND_SLOTS) {
+    for (SendSlot &slot : slots) {
+      slot.next = free_slots;
+      free_slots = &slot;
+    }
+    recv_msg.msg_namelen = recv_name;
+    recv_msg.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+  }
+
+  Uring uring;
+  BufferRing can_buffers;
+  BufferRing udp_buffers;
+
+  // multishot recvmsg, so the SO_TIMESTAMPNS control message comes along
+  void arm_recv(int fd, BufferRing &buffers, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring.get_sqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&recv_msg);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers.get_group();
+    sqe->user_data = user_data;
+  }
+
+  // locates the payload in a buffer filled by arm_recv(), nullptr if it is truncated
+  const uint8_t *payload(const uint8_t *buffer, size_t &len, uint64_t &stamp, const struct sockaddr *&src) {
+    if (len < recv_header) {
+      return nullptr;
+    }
+
+    struct io_uring_recvmsg_out out;
+    memcpy(&out, buffer, sizeof(out));
+    if (out.flags & MSG_TRUNC || out.payloadlen > len - recv_header) {
+      return nullptr;
+    }
+
+    struct msghdr msg = {};
+    msg.msg_control = const_cast<uint8_t *>(buffer + sizeof(out) + recv_name);
+    msg.msg_controllen = out.controllen;
+    stamp = rx_stamp(msg);
+    src = out.namelen <= recv_name ? (const struct sockaddr *)(buffer + sizeof(out)) : nullptr;
+    len = out.payloadlen;
+    return buffer + recv_header;
+  }
+
+  void arm_poll(int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring.get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+  }
+
+  // cancels everything pending on the socket, the fd has to stay open until this is submitted
+  void cancel(int fd) {
+    struct io_uring_sqe *sqe = uring.get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = event_tag(nullptr, EVENT_CANCEL);
+    uring.submit(0);
+  }
+
+  // queues a copy of the data, falls back to a plain syscall while all slots are in flight
+  // the record is booked once the send completed, txtime as for set_txtime()
+  // with an owner, a send that would block is left to it: false for the syscall, see complete_send() for the slot
+  bool send(int fd, const void *data, size_t len, const struct sockaddr *dst, socklen_t dst_len, const SendRecord &record,
+            uint64_t txtime = 0, Bridge *owner = nullptr, uint64_t age = 0) {
+    if (fd < 0) {
+      book_send(record, -EBADF);
+      return true;
+    }
+
+    SendSlot *slot = free_slots;
+    if (!slot) {
+      struct iovec iov = {const_cast<void *>(data), len};
+      char control[TXTIME_CONTROL_SIZE];
+      struct msghdr msg = {};
+      msg.msg_name = const_cast<struct sockaddr *>(dst);
+      msg.msg_namelen = dst_len;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      set_txtime(msg, control, txtime);
+      int res = sendmsg(fd, &msg, 0) < 0 ? -errno : 0;
+      if (owner && would_block(res)) {
+        return false;
+      }
+      book_send(record, res);
+      return true;
+    }
+    free_slots = slot->next;
+
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    slot->owner = owner;
+    slot->age = age;
+    if (owner) {
+      owner->sending++;
+    }
+    slot->record = record;
+    snprintf(slot->bridge, sizeof(slot->bridge), "%s", record.bridge);
+    memcpy(slot->stamps, record.stamps, record.count * sizeof(*record.stamps));
+    slot->record.bridge = slot->bridge;
+    slot->record.stamps = slot->stamps;
+    struct io_uring_sqe *sqe = uring.get_sqe();
+    sqe->fd = fd;
+    sqe->user_data = event_tag(slot, EVENT_SEND);
+    if (dst || txtime) {
+      slot->iov = {slot->data, len};
+      slot->msg = {};
+      if (dst) {
+        memcpy(&slot->dst, dst, dst_len);
+        slot->msg.msg_name = &slot->dst;
+        slot->msg.msg_namelen = dst_len;
+      }
+      slot->msg.msg_iov = &slot->iov;
+      slot->msg.msg_iovlen = 1;
+      set_txtime(slot->msg, slot->control, txtime);
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->addr = reinterpret_cast<uintptr_t>(&slot->msg);
+      sqe->len = 1;
+    } else {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->addr = reinterpret_cast<uintptr_t>(slot->data);
+      sqe->len = len;
+    }
+    return true;
+  }
+
+  // the sockets are non-blocking, so a full socket buffer or vcan TX queue fails the send with EAGAIN or ENOBUFS
+  // instead of waiting: the owner's frame goes back into its queue, a datagram is lost like after any other error
+  // returns whether a frame was parked, its queue has to be retried
+  bool complete_send(SendSlot *slot, int res) {
+    Bridge *owner = slot->owner;
+    if (owner) {
+      owner->sending--;
+    }
+
+    bool parked = owner && !owner->dying && would_block(res);
+    if (parked) {
+      park(*owner, *slot);
+    } else {
+      if (res < 0 && !would_block(res)) {
+        fprintf(stderr, "%s: send failed: %s\n", slot->bridge, strerror(-res));
+      }
+      book_send(slot->record, res);
+    }
+    slot->next = free_slots;
+    free_slots = slot;
+    return parked;
+  }
+
+  static bool would_block(int res) {
+    return res == -EAGAIN || res == -EWOULDBLOCK || res == -ENOBUFS;
+  }
+
+  // the frame as the endpoint queues it, the queue writes it with the same receive timestamp
+  static void park(Bridge &owner, const SendSlot &slot) {
+    struct canfd_frame frame = {};
+    memcpy(&frame, slot.data, std::min(slot.len, sizeof(frame)));
+    CANEndpoint::decode(frame, slot.len);
+    owner.can.tx.push(frame, slot.stamps[0], slot.age);
+  }
+
+ private:
+  std::vector<SendSlot> slots;
+  SendSlot *free_slots = nullptr;
+  struct msghdr recv_msg = {};
+};
+
+enum class Backend {
+  EPOLL,
+  IO_URING,
+};
+
+class Runner;
+
+// avahi leaves the definition of watches and timeouts to the poll implementation
+struct alignas(16) AvahiWatch {
+  Runner *runner;
+  int fd;
+  AvahiWatchEvent revents;
+  AvahiWatchCallback callback;
+  void *userdata;
+  bool dead;
+};
+
+struct alignas(16) AvahiTimeout {
+  Runner *runner;
+  int fd;
+  AvahiTimeoutCallback callback;
+  void *userdata;
+  bool dead;
+};
+
+struct Command {
+  enum Type { ADD,
+              REMOVE } type;
+  char name[IF_NAMESIZE];
+  char addr[AVAHI_ADDRESS_STR_MAX + IF_NAMESIZE + 1];
+  uint16_t port;
+  Mux mux;
+  Transport transport;
+  CANFilter filter;
+  // the gateway sends CAN FD frames, classic ones only otherwise
+  bool fd_frames;
+};
+
+// lock-free ring for exactly one producer and one consumer thread
+template <typename T, size_t N>
+class SPSCQueue {
+ public:
+  bool push(const T &item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+
+    items[t % N] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+
+    item = items[h % N];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::array<T, N> items;
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+};
+
+// per-thread counters of a runner's loop
+struct alignas(64) RunnerStats {
+  // frames moved between endpoints at once
+  Histogram<BATCH_HISTOGRAM_BUCKETS> batch_frames;
+  // time spent handling one wakeup, in nanoseconds
+  Histogram<LOOP_HISTOGRAM_BUCKETS> loop_ns;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+class Runner {
+ public:
+  Runner(Backend backend, OverflowPolicy policy) : backend(backend), policy(policy) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+      perror("epoll_create1");
+      exit(1);
+    }
+
+    cmd_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cmd_fd < 0) {
+      perror("eventfd");
+      exit(1);
+    }
+    add_epoll(cmd_fd, this, EVENT_COMMAND);
+
+    retry_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (retry_fd < 0) {
+      perror("timerfd_create");
+      exit(1);
+    }
+    add_epoll(retry_fd, this, EVENT_RETRY);
+
+    reopen_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (reopen_fd < 0) {
+      perror("timerfd_create");
+      exit(1);
+    }
+    add_epoll(reopen_fd, this, EVENT_REOPEN);
+
+    clock_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (clock_fd < 0) {
+      perror("timerfd_create");
+      exit(1);
+    }
+    struct itimerspec clock_spec = {};
+    clock_spec.it_interval.tv_sec = CLOCK_SYNC_INTERVAL_MS / 1000;
+    clock_spec.it_interval.tv_nsec = (CLOCK_SYNC_INTERVAL_MS % 1000) * 1000000;
+    clock_spec.it_value = clock_spec.it_interval;
+    if (timerfd_settime(clock_fd, 0, &clock_spec, nullptr) != 0) {
+      perror("timerfd_settime");
+      exit(1);
+    }
+    add_epoll(clock_fd, this, EVENT_CLOCK);
+
+    // link-up events cut the backoff short, bridges are still reopened without them
+    link_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    struct sockaddr_nl nl = {};
+    nl.nl_family = AF_NETLINK;
+    nl.nl_groups = RTMGRP_LINK;
+    if (link_fd < 0 || bind(link_fd, (struct sockaddr *)&nl, sizeof(nl)) != 0) {
+      perror("netlink");
+    } else {
+      add_epoll(link_fd, this, EVENT_LINK);
+    }
+
+    avahi_poll.userdata = this;
+    avahi_poll.watch_new = watch_new;
+    avahi_poll.watch_update = watch_update;
+    avahi_poll.watch_get_events = watch_get_events;
+    avahi_poll.watch_free = watch_free;
+    avahi_poll.timeout_new = timeout_new;
+    avahi_poll.timeout_update = timeout_update;
+    avahi_poll.timeout_free = timeout_free;
+  }
+
+  // AvahiPoll dispatching avahi's sockets and timers from this runner's loop
+  const AvahiPoll *get_avahi_poll() const {
+    return &avahi_poll;
+  }
+
+  // queues a bridge change for the runner thread, safe to call from one other thread
+  bool submit(const Command &cmd) {
+    if (!commands.push(cmd)) {
+      fprintf(stderr, "Command queue full, dropping change of %s\n", cmd.name);
+      return false;
+    }
+
+    uint64_t one = 1;
+    if (::write(cmd_fd, &one, sizeof(one)) != sizeof(one)) {
+      perror("eventfd write");
+    }
+    return true;
+  }
+
+  void add(const char *canif_name, const char *addr, uint16_t port, const Mux &mux, Transport transport, const CANFilter &filter, bool fd_frames) {
+    if (Bridge *bridge = find(canif_name)) {
+      update(*bridge, addr, port, mux, transport, filter, fd_frames);
+      return;
+    }
+
+    std::optional<Bridge> *slot = free_slot();
+    if (!slot) {
+      fprintf(stderr, "Can't bridge %s, all %d bridges in use\n", canif_name, MAX_BRIDGES);
+      return;
+    }
+
+    const char *over = transport == Transport::ETH ? " over raw Ethernet" : "";
+    if (mux.port) {
+      printf("Bridging %s <-> %s:%d%s, channel %d multiplexed on %d\n", canif_name, addr, port, over, mux.channel, mux.port);
+    } else {
+      printf("Bridging %s <-> %s:%d%s\n", canif_name, addr, port, over);
+    }
+    BridgeStats &counters = bridge_stats[slot - bridges.data()];
+    counters.assign(canif_name);
+    Bridge &bridge = slot->emplace(canif_name, addr, port, mux, transport, filter, fd_frames, policy, counters);
+    bridge.udp.set_reader(!mux_reader(bridge));
+
+    open_side(bridge, EVENT_CAN);
+    open_side(bridge, EVENT_UDP);
+  }
+
+  void remove(const char *canif_name) {
+    Bridge *bridge = find(canif_name);
+    if (!bridge) {
+      return;
+    }
+
+    printf("Removing bridge %s\n", canif_name);
+    hand_over(*bridge);
+    if (uring && !bridge->idle()) {
+      // released once the kernel completed both receives and the sends
+      bridge->dying = true;
+      if (bridge->can.is_open()) {
+        uring->cancel(bridge->can.get_fd());
+      }
+      if (bridge->udp.is_open()) {
+        uring->cancel(bridge->udp.get_fd());
+      }
+      return;
+    }
+
+    if (!uring) {
+      if (bridge->can.is_open()) {
+        del_epoll(bridge->can.get_fd());
+      }
+      if (bridge->udp.is_open()) {
+        del_epoll(bridge->udp.get_fd());
+      }
+    }
+    release(*bridge);
+  }
+
+  Bridge *find(const char *canif_name) {
+    for (std::optional<Bridge> &slot : bridges) {
+      if (slot && !slot->dying && strcmp(slot->name, canif_name) == 0) {
+        return &*slot;
+      }
+    }
+    return nullptr;
+  }
+
+  // re-announcements keep the bridge, a new address or port swaps the UDP side only
+  void update(Bridge &bridge, const char *addr, uint16_t port, const Mux &mux, Transport transport, const CANFilter &filter, bool fd_frames) {
+    if (!(bridge.can.get_filter() == filter)) {
+      printf("Refiltering %s\n", bridge.name);
+      bridge.can.set_filter(filter);
+    }
+    if (bridge.can.get_fd_frames() != fd_frames) {
+      bridge.can.set_fd_frames(fd_frames);
+    }
+    if (bridge.port == port && bridge.mux == mux && bridge.transport == transport && strcmp(bridge.addr, addr) == 0) {
+      return;
+    }
+
+    printf("Rebridging %s <-> %s:%d\n", bridge.name, addr, port);
+    hand_over(bridge);
+    snprintf(bridge.addr, sizeof(bridge.addr), "%s", addr);
+    bridge.port = port;
+    bridge.mux = mux;
+    bridge.transport = transport;
+
+    UDPEndpoint udp(addr, port, mux, transport, policy, bridge.stats->udp);
+    udp.set_reader(!mux_reader(bridge));
+    bool opened = udp.open();
+    unwatch(bridge, EVENT_UDP);
+    bridge.udp = std::move(udp);
+    if (opened) {
+      started(bridge, EVENT_UDP);
+    } else {
+      schedule_reopen(bridge, EVENT_UDP);
+    }
+  }
+
+  const RunnerStats &get_stats() const {
+    return stats;
+  }
+
+  // counters of all bridge slots, safe to read from any thread
+  const std::array<BridgeStats, MAX_BRIDGES> &get_bridge_stats() const {
+    return bridge_stats;
+  }
+
+  void run() {
+    if (backend == Backend::IO_URING) {
+      // IORING_SETUP_SINGLE_ISSUER binds the ring to the thread creating it
+      uring = std::make_unique<UringBackend>();
+      run_uring();
+    } else {
+      run_epoll();
+    }
+  }
+
+ private:
+  int epoll_fd;
+  int cmd_fd;
+  int retry_fd;
+  bool retry_armed = false;
+  int reopen_fd;
+  int clock_fd;
+  int link_fd;
+  Backend backend;
+  OverflowPolicy policy;
+  std::array<std::optional<Bridge>, MAX_BRIDGES> bridges;
+  std::array<BridgeStats, MAX_BRIDGES> bridge_stats;
+  RunnerStats stats;
+  FrameBatch batch;
+  SPSCQueue<Command, COMMAND_QUEUE_SIZE> commands;
+  std::unique_ptr<UringBackend> uring;
+  // bridge whose CAN frames are collected in the batch by the io_uring backend
+  Bridge *pending = nullptr;
+
+  static constexpr size_t max_events = 16;
+
+  void run_epoll() {
+    for (;;) {
+      struct epoll_event evts[max_events];
+      int nfds = epoll_wait(epoll_fd, evts, max_events, -1);
+      if (nfds == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("epoll_wait");
+        exit(1);
+      }
+
+      uint64_t start = now_ns();
+      dispatch(evts, nfds);
+      stats.loop_ns.observe(now_ns() - start);
+    }
+  }
+
+  // with io_uring, the epoll set only carries the control plane and is polled through the ring
+  void run_uring() {
+    uring->arm_poll(epoll_fd, event_tag(this, EVENT_EPOLL));
+    for (;;) {
+      uring->uring.submit(1);
+
+      uint64_t start = now_ns();
+      bool control = false;
+      uring->uring.for_each_cqe([&](const struct io_uring_cqe &cqe) {
+        void *ptr = reinterpret_cast<void *>(cqe.user_data & ~EVENT_TAG_MASK);
+        switch (cqe.user_data & EVENT_TAG_MASK) {
+          case EVENT_CAN:
+            complete_recv(*static_cast<Bridge *>(ptr), EVENT_CAN, cqe);
+            break;
+          case EVENT_UDP:
+            complete_recv(*static_cast<Bridge *>(ptr), EVENT_UDP, cqe);
+            break;
+          case EVENT_SEND: {
+            SendSlot *slot = static_cast<SendSlot *>(ptr);
+            Bridge *owner = slot->owner;
+            if (uring->complete_send(slot, cqe.res)) {
+              arm_retry();
+            } else if (owner && owner->dying && owner->idle()) {
+              release(*owner);
+            }
+            break;
+          }
+          case EVENT_EPOLL:
+            control = true;
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+              uring->arm_poll(epoll_fd, event_tag(this, EVENT_EPOLL));
+            }
+            break;
+        }
+      });
+      flush_pending();
+      uring->can_buffers.publish();
+      uring->udp_buffers.publish();
+
+      if (control) {
+        struct epoll_event evts[max_events];
+        int nfds = epoll_wait(epoll_fd, evts, max_events, 0);
+        if (nfds > 0) {
+          dispatch(evts, nfds);
+        }
+      }
+      stats.loop_ns.observe(now_ns() - start);
+    }
+  }
+
+  void complete_recv(Bridge &bridge, EventTag side, const struct io_uring_cqe &cqe) {
+    BufferRing &buffers = side == EVENT_CAN ? uring->can_buffers : uring->udp_buffers;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      size_t len = cqe.res > 0 ? cqe.res : 0;
+      uint64_t stamp = 0;
+      const struct sockaddr *src;
+      const uint8_t *data = uring->payload(buffers.get(bid), len, stamp, src);
+      if (!bridge.dying && data) {
+        if (side == EVENT_CAN) {
+          receive_can(bridge, data, len, stamp);
+        } else {
+          receive_udp(bridge, data, len, stamp, src);
+        }
+      }
+      buffers.recycle(bid);
+    }
+
+    if (cqe.flags & IORING_CQE_F_MORE) {
+      return;
+    }
+
+    // the multishot receive ended: buffers ran out, an error or our own cancellation
+    bridge.armed[side]--;
+    if (bridge.dying) {
+      if (bridge.idle()) {
+        release(bridge);
+      }
+    } else if (cqe.res != -ECANCELED && endpoint(bridge, side).is_open()) {
+      if (cqe.res < 0 && Endpoint::is_fault(-cqe.res)) {
+        fault(bridge, side, -cqe.res);
+        return;
+      }
+      if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+        fprintf(stderr, "%s: receive failed: %s\n", bridge.name, strerror(-cqe.res));
+      }
+      watch(bridge, side);
+    }
+  }
+
+  void receive_can(Bridge &bridge, const uint8_t *data, size_t len, uint64_t stamp) {
+    if (pending != &bridge) {
+      flush_pending();
+      pending = &bridge;
+    }
+
+    struct canfd_frame &frame = batch.frames[batch.count];
+    memcpy(&frame, data, std::min(len, sizeof(frame)));
+    if (!CANEndpoint::decode(frame, len)) {
+      fprintf(stderr, "%s: unexpected CAN frame size %zu\n", bridge.name, len);
+      return;
+    }
+
+    bridge.can.stats->rx(frame);
+    TRACE(can_rx, bridge.name, frame.can_id, canfd_len(frame));
+    batch.stamps[batch.count] = stamp;
+    batch.count++;
+    if (batch.full()) {
+      flush_pending();
+    }
+  }
+
+  // CAN frames of one bridge are coalesced into datagrams until another bridge or the end of the completions
+  void flush_pending() {
+    if (pending && batch.count) {
+      Bridge &bridge = *pending;
+      stats.batch_frames.observe(batch.count);
+      bridge.udp.encode(batch, [&](const uint8_t *tx, size_t len, size_t first, size_t count) {
+        uring->send(bridge.udp.get_fd(), tx, len, bridge.udp.get_dst(), bridge.udp.get_dst_len(), bridge.udp.record(batch, first, count));
+      });
+    }
+    batch.count = 0;
+    pending = nullptr;
+  }
+
+  void receive_udp(Bridge &bridge, const uint8_t *data, size_t len, uint64_t stamp, const struct sockaddr *src) {
+    flush_pending();
+    Bridge *channels[MAX_BRIDGES];
+    size_t count = channel_bridges(bridge, channels);
+    bridge.udp.receive(data, len, stamp, src, batch, [&](const FrameBatch &frames) {
+      stats.batch_frames.observe(frames.count);
+      for (size_t i = 0; i < frames.count; i++) {
+        Bridge *target = channel_bridge(channels, count, frames, i);
+        if (!target) {
+          continue;
+        }
+        send_can(*target, frames.frames[i], frames.stamps[i], frames.ages[i]);
+      }
+    });
+    batch.count = 0;
+  }
+
+  // frames wait in the endpoint's queue behind earlier ones or while the vcan's TX queue is full, retry() drains it
+  void send_can(Bridge &target, const struct canfd_frame &queued, uint64_t stamp, uint64_t age) {
+    if (target.can.tx.empty()) {
+      struct canfd_frame frame = queued;
+      size_t size = CANEndpoint::encode(frame);
+      SendRecord record = {target.can.stats, target.name, false, 0, queued.can_id, 1, canfd_len(queued), &stamp};
+      if (uring->send(target.can.get_fd(), &frame, size, nullptr, 0, record, target.can.txtime(stamp, age), &target, age)) {
+        return;
+      }
+    }
+    target.can.tx.push(queued, stamp, age);
+    arm_retry();
+  }
+
+  // the bridge demultiplexing the gateway's mux port for the given one's channel, nullptr if there is none yet
+  Bridge *mux_reader(const Bridge &bridge) {
+    for (std::optional<Bridge> &slot : bridges) {
+      if (slot && !slot->dying && &*slot != &bridge && slot->shares_mux(bridge) && slot->udp.demuxes()) {
+        return &*slot;
+      }
+    }
+    return nullptr;
+  }
+
+  // a leaving mux reader passes its role to another channel of the gateway, which rebinds to the mux port
+  void hand_over(Bridge &leaving) {
+    if (!leaving.udp.demuxes()) {
+      return;
+    }
+
+    for (std::optional<Bridge> &slot : bridges) {
+      if (slot && !slot->dying && &*slot != &leaving && slot->shares_mux(leaving)) {
+        unwatch(*slot, EVENT_UDP);
+        slot->udp.close();
+        slot->udp.set_reader(true);
+        open_side(*slot, EVENT_UDP);
+        return;
+      }
+    }
+  }
+
+  // the bridges whose frames a datagram of the given one's gateway carries, itself first
+  size_t channel_bridges(Bridge &bridge, Bridge **channels) {
+    size_t count = 0;
+    channels[count++] = &bridge;
+    if (!bridge.udp.demuxes()) {
+      return count;
+    }
+
+    for (std::optional<Bridge> &slot : bridges) {
+      if (slot && !slot->dying && &*slot != &bridge && slot->shares_mux(bridge)) {
+        channels[count++] = &*slot;
+      }
+    }
+    return count;
+  }
+
+  // the bridge of a decoded frame's channel, which accounts for it unless it decoded it itself
+  // nullptr if no bridge on this runner takes the channel
+  static Bridge *channel_bridge(Bridge *const *channels, size_t count, const FrameBatch &frames, size_t i) {
+    for (size_t k = 0; k < count; k++) {
+      Bridge *bridge = channels[k];
+      if (bridge->mux.channel != frames.channels[i]) {
+        continue;
+      }
+      if (k) {
+        bridge->udp.stats->rx(frames.frames[i]);
+        TRACE(frame_decode, bridge->name, frames.frames[i].can_id, canfd_len(frames.frames[i]));
+      }
+      return bridge;
+    }
+    return nullptr;
+  }
+
+  // starts receiving on one side of the bridge
+  void watch(Bridge &bridge, EventTag side) {
+    if (uring) {
+      BufferRing &buffers = side == EVENT_CAN ? uring->can_buffers : uring->udp_buffers;
+      int fd = side == EVENT_CAN ? bridge.can.get_fd() : bridge.udp.get_fd();
+      uring->arm_recv(fd, buffers, event_tag(&bridge, side));
+      bridge.armed[side]++;
+    } else {
+      add_epoll(side == EVENT_CAN ? bridge.can.get_fd() : bridge.udp.get_fd(), &bridge, side);
+    }
+  }
+
+  void release(Bridge &bridge) {
+    if (pending == &bridge) {
+      pending = nullptr;
+      batch.count = 0;
+    }
+
+    for (std::optional<Bridge> &slot : bridges) {
+      if (slot && &*slot == &bridge) {
+        slot.reset();
+        bridge_stats[&slot - bridges.data()].assign(nullptr);
+      }
+    }
+    arm_reopen();
+  }
+
+  void dispatch(struct epoll_event *evts, int nfds) {
+    bool pending_commands = false;
+    for (int i = 0; i < nfds; i++) {
+      uintptr_t data = evts[i].data.u64;
+      void *ptr = reinterpret_cast<void *>(data & ~EVENT_TAG_MASK);
+      Bridge *bridge = static_cast<Bridge *>(ptr);
+
+      switch (data & EVENT_TAG_MASK) {
+        case EVENT_CAN:
+          if (evts[i].events & EPOLLOUT) {
+            drain(*bridge, EVENT_CAN);
+          }
+          if (evts[i].events & ~EPOLLOUT) {
+            forward(bridge->can, bridge->udp);
+            sync(*bridge, EVENT_UDP);
+          }
+          check(*bridge);
+          break;
+        case EVENT_UDP:
+          if (evts[i].events & EPOLLOUT) {
+            drain(*bridge, EVENT_UDP);
+          }
+          if (evts[i].events & ~EPOLLOUT) {
+            if (bridge->udp.demuxes()) {
+              forward_mux(*bridge);
+            } else {
+              forward(bridge->udp, bridge->can);
+              sync(*bridge, EVENT_CAN);
+            }
+          }
+          check(*bridge);
+          break;
+        case EVENT_COMMAND:
+          pending_commands = true;
+          break;
+        case EVENT_RETRY:
+          retry();
+          break;
+        case EVENT_REOPEN:
+          reopen();
+          break;
+        case EVENT_LINK:
+          link_changed();
+          break;
+        case EVENT_CLOCK:
+          exchange_time();
+          break;
+        case EVENT_AVAHI_WATCH:
+          dispatch_watch(static_cast<AvahiWatch *>(ptr), evts[i].events);
+          break;
+        case EVENT_AVAHI_TIMEOUT:
+          dispatch_timeout(static_cast<AvahiTimeout *>(ptr));
+          break;
+      }
+    }
+
+    // applied after the batch, so no event above refers to a removed bridge
+    if (pending_commands) {
+      process_commands();
+    }
+    collect_garbage();
+  }
+
+  AvahiPoll avahi_poll = {};
+  // freed avahi objects are kept until the end of the batch, events may still point at them
+  std::vector<AvahiWatch *> dead_watches;
+  std::vector<AvahiTimeout *> dead_timeouts;
+
+  static uint32_t to_epoll_events(AvahiWatchEvent event) {
+    uint32_t events = 0;
+    if (event & AVAHI_WATCH_IN) {
+      events |= EPOLLIN;
+    }
+    if (event & AVAHI_WATCH_OUT) {
+      events |= EPOLLOUT;
+    }
+    return events;
+  }
+
+  static AvahiWatchEvent to_avahi_events(uint32_t events) {
+    int event = 0;
+    if (events & EPOLLIN) {
+      event |= AVAHI_WATCH_IN;
+    }
+    if (events & EPOLLOUT) {
+      event |= AVAHI_WATCH_OUT;
+    }
+    if (events & EPOLLERR) {
+      event |= AVAHI_WATCH_ERR;
+    }
+    if (events & EPOLLHUP) {
+      event |= AVAHI_WATCH_HUP;
+    }
+    return (AvahiWatchEvent)event;
+  }
+
+  static AvahiWatch *watch_new(const AvahiPoll *api, int fd, AvahiWatchEvent event, AvahiWatchCallback callback, void *userdata) {
+    Runner *runner = static_cast<Runner *>(api->userdata);
+    AvahiWatch *w = new AvahiWatch{runner, fd, (AvahiWatchEvent)0, callback, userdata, false};
+    runner->add_epoll(fd, w, EVENT_AVAHI_WATCH, to_epoll_events(event));
+    return w;
+  }
+
+  static void watch_update(AvahiWatch *w, AvahiWatchEvent event) {
+    struct epoll_event evt = {0};
+    evt.events = to_epoll_events(event);
+    evt.data.u64 = event_tag(w, EVENT_AVAHI_WATCH);
+    if (epoll_ctl(w->runner->epoll_fd, EPOLL_CTL_MOD, w->fd, &evt) == -1) {
+      perror("epoll_ctl");
+    }
+  }
+
+  static AvahiWatchEvent watch_get_events(AvahiWatch *w) {
+    return w->revents;
+  }
+
+  static void watch_free(AvahiWatch *w) {
+    w->runner->del_epoll(w->fd);
+    w->dead = true;
+    w->runner->dead_watches.push_back(w);
+  }
+
+  void dispatch_watch(AvahiWatch *w, uint32_t events) {
+    if (w->dead) {
+      return;
+    }
+    w->revents = to_avahi_events(events);
+    w->callback(w, w->fd, w->revents, w->userdata);
+  }
+
+  // avahi passes absolute gettimeofday() deadlines, NULL disarms the timeout
+  static void arm_timeout(AvahiTimeout *t, const struct timeval *tv) {
+    struct itimerspec spec = {};
+    if (tv) {
+      spec.it_value.tv_sec = tv->tv_sec;
+      spec.it_value.tv_nsec = tv->tv_usec * 1000;
+      if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+        // zero would disarm the timer, expire immediately instead
+        spec.it_value.tv_nsec = 1;
+      }
+    }
+
+    if (timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &spec, nullptr) != 0) {
+      perror("timerfd_settime");
+    }
+  }
+
+  static AvahiTimeout *timeout_new(const AvahiPoll *api, const struct timeval *tv, AvahiTimeoutCallback callback, void *userdata) {
+    Runner *runner = static_cast<Runner *>(api->userdata);
+    int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+      perror("timerfd_create");
+      return nullptr;
+    }
+
+    AvahiTimeout *t = new AvahiTimeout{runner, fd, callback, userdata, false};
+    arm_timeout(t, tv);
+    runner->add_epoll(fd, t, EVENT_AVAHI_TIMEOUT);
+    return t;
+  }
+
+  static void timeout_update(AvahiTimeout *t, const struct timeval *tv) {
+    arm_timeout(t, tv);
+  }
+
+  static void timeout_free(AvahiTimeout *t) {
+    t->runner->del_epoll(t->fd);
+    close(t->fd);
+    t->dead = true;
+    t->runner->dead_timeouts.push_back(t);
+  }
+
+  void dispatch_timeout(AvahiTimeout *t) {
+    uint64_t expirations;
+    if (t->dead || ::read(t->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      return;
+    }
+    t->callback(t, t->userdata);
+  }
+
+  void collect_garbage() {
+    for (AvahiWatch *w : dead_watches) {
+      delete w;
+    }
+    dead_watches.clear();
+
+    for (AvahiTimeout *t : dead_timeouts) {
+      delete t;
+    }
+    dead_timeouts.clear();
+  }
+
+  void process_commands() {
+    uint64_t value;
+    if (::read(cmd_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+      perror("eventfd read");
+    }
+
+    Command cmd;
+    while (commands.pop(cmd)) {
+      switch (cmd.type) {
+        case Command::ADD:
+          add(cmd.name, cmd.addr, cmd.port, cmd.mux, cmd.transport, cmd.filter, cmd.fd_frames);
+          break;
+        case Command::REMOVE:
+          remove(cmd.name);
+          break;
+      }
+    }
+  }
+
+  template <typename Rx, typename Tx>
+  void forward(Rx &rx, Tx &tx) {
+    batch.count = 0;
+    rx.read(batch, [&](const FrameBatch &frames) {
+      stats.batch_frames.observe(frames.count);
+      tx.write(frames);
+    });
+  }
+
+  // a mux reader's datagrams carry the frames of all the gateway's channels, each goes to its bridge's CAN endpoint
+  void forward_mux(Bridge &reader) {
+    Bridge *channels[MAX_BRIDGES];
+    size_t count = channel_bridges(reader, channels);
+    batch.count = 0;
+    reader.udp.read(batch, [&](const FrameBatch &frames) {
+      stats.batch_frames.observe(frames.count);
+      for (size_t i = 0; i < frames.count; i++) {
+        if (Bridge *target = channel_bridge(channels, count, frames, i)) {
+          target->can.tx.push(frames.frames[i], frames.stamps[i], frames.ages[i]);
+        }
+      }
+      for (size_t k = 0; k < count; k++) {
+        channels[k]->can.flush();
+      }
+    });
+
+    for (size_t k = 0; k < count; k++) {
+      sync(*channels[k], EVENT_CAN);
+      // the reader's own endpoints are checked by the caller
+      if (k) {
+        check(*channels[k]);
+      }
+    }
+  }
+
+  Endpoint &endpoint(Bridge &bridge, EventTag side) {
+    if (side == EVENT_CAN) {
+      return bridge.can;
+    }
+    return bridge.udp;
+  }
+
+  void drain(Bridge &bridge, EventTag side) {
+    if (side == EVENT_CAN) {
+      bridge.can.flush();
+    } else {
+      bridge.udp.flush();
+    }
+    sync(bridge, side);
+  }
+
+  // waits for EPOLLOUT while frames are queued, ENOBUFS stalls and io_uring's sockets outside the epoll set are retried on the timer
+  void sync(Bridge &bridge, EventTag side) {
+    Endpoint &ep = endpoint(bridge, side);
+    if (!ep.is_open()) {
+      return;
+    }
+
+    uint32_t events = EPOLLIN;
+    if (!ep.tx.empty()) {
+      if (uring || ep.get_blocked() == ENOBUFS) {
+        arm_retry();
+      } else {
+        events |= EPOLLOUT;
+      }
+    } else if (ep.tx.drops.get() != bridge.reported_drops[side]) {
+      fprintf(stderr, "%s: dropped %llu frames towards %s\n", bridge.name,
+              (unsigned long long)(ep.tx.drops.get() - bridge.reported_drops[side]), side_name(side));
+      bridge.reported_drops[side] = ep.tx.drops.get();
+    }
+
+    if (!uring && events != bridge.events[side]) {
+      struct epoll_event evt = {0};
+      evt.events = events;
+      evt.data.u64 = event_tag(&bridge, side);
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ep.get_fd(), &evt) == -1) {
+        perror("epoll_ctl");
+      }
+      bridge.events[side] = events;
+    }
+  }
+
+  void arm_retry() {
+    if (retry_armed) {
+      return;
+    }
+
+    struct itimerspec spec = {};
+    spec.it_value.tv_nsec = TX_RETRY_NS;
+    if (timerfd_settime(retry_fd, 0, &spec, nullptr) != 0) {
+      perror("timerfd_settime");
+      return;
+    }
+    retry_armed = true;
+  }
+
+  void retry() {
+    uint64_t expirations;
+    if (::read(retry_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      return;
+    }
+    retry_armed = false;
+
+    for (std::optional<Bridge> &slot : bridges) {
+      if (slot && !slot->can.tx.empty()) {
+        drain(*slot, EVENT_CAN);
+      }
+      if (slot && !slot->udp.tx.empty()) {
+        drain(*slot, EVENT_UDP);
+      }
+    }
+  }
+
+  void open_side(Bridge &bridge, EventTag side) {
+    bool opened = side == EVENT_CAN ? bridge.can.open() : bridge.udp.open();
+    if (opened) {
+      started(bridge, side);
+    } else {
+      schedule_reopen(bridge, side);
+    }
+  }
+
+  void started(Bridge &bridge, EventTag side) {
+    bridge.reopen_at[side] = 0;
+    bridge.backoff_ms[side] = 0;
+    bridge.events[side] = EPOLLIN;
+    watch(bridge, side);
+    if (!uring) {
+      // frames queued while the endpoint was closed
+      drain(bridge, side);
+    }
+  }
+
+  void unwatch(Bridge &bridge, EventTag side) {
+    Endpoint &ep = endpoint(bridge, side);
+    if (!ep.is_open()) {
+      return;
+    }
+
+    if (uring) {
+      uring->cancel(ep.get_fd());
+    } else {
+      del_epoll(ep.get_fd());
+    }
+  }
+
+  // closes a broken endpoint, the other side and all other bridges keep running
+  void fault(Bridge &bridge, EventTag side, int err) {
+    fprintf(stderr, "%s: %s endpoint failed: %s\n", bridge.name, side_name(side), strerror(err));
+    endpoint(bridge, side).stats->faults.add(1);
+    unwatch(bridge, side);
+    endpoint(bridge, side).close();
+    schedule_reopen(bridge, side);
+  }
+
+  void check(Bridge &bridge) {
+    for (EventTag side : {EVENT_CAN, EVENT_UDP}) {
+      Endpoint &ep = endpoint(bridge, side);
+      if (ep.is_open() && ep.get_error()) {
+        fault(bridge, side, ep.get_error());
+      }
+    }
+  }
+
+  void schedule_reopen(Bridge &bridge, EventTag side) {
+    uint32_t &backoff = bridge.backoff_ms[side];
+    backoff = backoff ? std::min(backoff * 2, (uint32_t)REOPEN_MAX_MS) : REOPEN_MIN_MS;
+    bridge.reopen_at[side] = now_ms() + backoff;
+    printf("%s: %s endpoint down, retrying in %u ms\n", bridge.name, side_name(side), backoff);
+    arm_reopen();
+  }
+
+  // the timer fires at the earliest reopen attempt of all bridges
+  void arm_reopen() {
+    uint64_t next = 0;
+    for (std::optional<Bridge> &slot : bridges) {
+      for (EventTag side : {EVENT_CAN, EVENT_UDP}) {
+        if (slot && !slot->dying && slot->reopen_at[side] && (!next || slot->reopen_at[side] < next)) {
+          next = slot->reopen_at[side];
+        }
+      }
+    }
+
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = next / 1000;
+    spec.it_value.tv_nsec = (next % 1000) * 1000000;
+    if (timerfd_settime(reopen_fd, TFD_TIMER_ABSTIME, &spec, nullptr) != 0) {
+      perror("timerfd_settime");
+    }
+  }
+
+  void reopen() {
+    uint64_t expirations;
+    if (::read(reopen_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      return;
+    }
+
+    uint64_t now = now_ms();
+    for (std::optional<Bridge> &slot : bridges) {
+      for (EventTag side : {EVENT_CAN, EVENT_UDP}) {
+        if (!slot || slot->dying || !slot->reopen_at[side] || slot->reopen_at[side] > now) {
+          continue;
+        }
 
-  int get_fd() const {
-    return fd;
+        bool opened = side == EVENT_CAN ? slot->can.open() : slot->udp.open();
+        if (opened) {
+          printf("%s: %s endpoint up\n", slot->name, side_name(side));
+          started(*slot, side);
+        } else {
+          schedule_reopen(*slot, side);
+        }
+      }
+    }
+    arm_reopen();
   }
 
- protected:
-  int fd;
-};
+  // one clock exchange with the gateway of every bridge
+  void exchange_time() {
+    uint64_t expirations;
+    if (::read(clock_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      return;
+    }
 
-class CANEndpoint : public Endpoint {
- public:
-  CANEndpoint(const char *if_name) {
-    fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
-    if (fd == -1) {
-      perror("socket");
-      exit(1);
+    for (std::optional<Bridge> &slot : bridges) {
+      if (slot && !slot->dying && slot->udp.is_open()) {
+        slot->udp.request_time();
+      }
     }
+  }
 
-    struct ifreq ifr;
-    strcpy(ifr.ifr_name, if_name);
-    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
-      perror("ioctl");
-      exit(1);
+  // an interface came up, retry all closed endpoints right away
+  void link_changed() {
+    bool up = false;
+    for (;;) {
+      uint8_t buffer[8192];
+      ssize_t n = recv(link_fd, buffer, sizeof(buffer), 0);
+      if (n < 0) {
+        // ENOBUFS: the socket overran and events were lost
+        up |= errno == ENOBUFS;
+        break;
+      }
+
+      size_t len = n;
+      for (struct nlmsghdr *nlh = (struct nlmsghdr *)buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+        if (nlh->nlmsg_type == RTM_NEWLINK) {
+          struct ifinfomsg *ifi = (struct ifinfomsg *)NLMSG_DATA(nlh);
+          up |= (ifi->ifi_flags & IFF_UP) != 0;
+        }
+      }
     }
 
-    struct sockaddr_can addr;
-    addr.can_family = AF_CAN;
-    addr.can_ifindex = ifr.ifr_ifindex;
-    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-      perror("bind");
-      exit(1);
+    if (!up) {
+      return;
+    }
+
+    uint64_t now = now_ms();
+    for (std::optional<Bridge> &slot : bridges) {
+      for (EventTag side : {EVENT_CAN, EVENT_UDP}) {
+        if (slot && slot->reopen_at[side]) {
+          slot->backoff_ms[side] = 0;
+          slot->reopen_at[side] = now;
+        }
+      }
     }
+    arm_reopen();
   }
 
-  void read(std::vector<struct can_frame> &frames) override {
-    struct can_frame frame;
-    size_t n = ::read(fd, &frame, sizeof(frame));
-    if (n != sizeof(frame)) {
-      fprintf(stderr, "read failed %d != %d\n", n, sizeof(frame));
-      exit(1);
+  std::optional<Bridge> *free_slot() {
+    for (std::optional<Bridge> &slot : bridges) {
+      if (!slot) {
+        return &slot;
+      }
     }
+    return nullptr;
+  }
 
-    frames.emplace_back(frame);
+  void add_epoll(int fd, void *ptr, EventTag tag, uint32_t events = EPOLLIN) {
+    struct epoll_event evt = {0};
+    evt.events = events;
+    evt.data.u64 = event_tag(ptr, tag);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &evt) == -1) {
+      perror("epoll_ctl");
+      exit(1);
+    }
   }
 
-  void write(std::vector<struct can_frame> &frames) override {
-    for (const struct can_frame &frame : frames) {
-      size_t n = ::write(fd, &frame, sizeof(frame));
-      if (n != sizeof(frame)) {
-        fprintf(stderr, "write failed %d != %d\n", n, sizeof(frame));
-        exit(1);
-      }
+  void del_epoll(int fd) {
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) == -1) {
+      perror("epoll_ctl");
     }
   }
 };
 
-class UDPEndpoint : public Endpoint {
+// runners on their own threads, each owning a subset of the bridges
+class Shards {
  public:
-  UDPEndpoint(const char *addr, uint16_t port) {
-    char service[16];
-    snprintf(service, sizeof(service), "%d", port);
-    struct addrinfo hints = {};
-    hints.ai_family = AF_INET6;
-    hints.ai_socktype = SOCK_DGRAM;
-    struct addrinfo *res = nullptr;
-    if (getaddrinfo(addr, service, &hints, &res) != 0) {
-      perror("getaddrinfo");
-      exit(1);
+  Shards(size_t count, Backend backend, OverflowPolicy policy) {
+    for (size_t i = 0; i < count; i++) {
+      runners.emplace_back(std::make_unique<Runner>(backend, policy));
     }
+    load.resize(count);
+  }
 
-    fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
-    if (fd < 0) {
-      perror("socket creation failed");
-      exit(1);
+  // discovery and the control plane run on the first shard, metrics on a thread of their own
+  Runner &control() {
+    return *runners[0];
+  }
+
+  const std::vector<std::unique_ptr<Runner>> &get_runners() const {
+    return runners;
+  }
+
+  // routes a bridge change to the shard owning it, new bridges go to the least loaded one
+  void submit(const Command &cmd) {
+    auto it = owners.find(cmd.name);
+    if (cmd.type == Command::REMOVE) {
+      if (it == owners.end()) {
+        return;
+      }
+      load[it->second]--;
+      runners[it->second]->submit(cmd);
+      owners.erase(it);
+      return;
     }
 
-    int enabled = 1;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) != 0) {
-      perror("setsockopt(SOL_SOCKET, SO_REUSEADDR)");
-      exit(1);
+    size_t shard;
+    if (it != owners.end()) {
+      shard = it->second;
+    } else {
+      shard = 0;
+      for (size_t i = 1; i < load.size(); i++) {
+        if (load[i] < load[shard]) {
+          shard = i;
+        }
+      }
+      // all channels of a multiplexing gateway share the shard that reads its mux port
+      if (cmd.mux.port) {
+        std::string gateway = std::string(cmd.addr) + "/" + std::to_string(cmd.mux.port) + (cmd.transport == Transport::ETH ? "/eth" : "");
+        shard = mux_owners.emplace(gateway, shard).first->second;
+      }
+      owners[cmd.name] = shard;
+      load[shard]++;
     }
+    runners[shard]->submit(cmd);
+  }
 
-    struct sockaddr_in6 server_addr;
-    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
-    server_addr.sin6_addr.s6_addr16[0] = htons(0xff02);
-    if (bind(fd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-      perror("bind failed");
-      exit(1);
+  // runs all shards, the calling thread becomes the first one
+  void run(const std::vector<int> &cpus) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < runners.size(); i++) {
+      threads.emplace_back([this, i] { runners[i]->run(); });
+      pin(threads.back().native_handle(), i, cpus);
     }
 
-    struct ipv6_mreq mreq = {};
-    mreq.ipv6mr_multiaddr = server_addr.sin6_addr;
-    mreq.ipv6mr_interface = server_addr.sin6_scope_id;
-    if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) != 0) {
-      perror("setsockopt(PPROTO_IPV6, IPV6_JOIN_GROUP)");
+    pin(pthread_self(), 0, cpus);
+    runners[0]->run();
+  }
+
+ private:
+  std::vector<std::unique_ptr<Runner>> runners;
+  std::vector<size_t> load;
+  std::map<std::string, size_t> owners;
+  // shard of each multiplexing gateway, kept after its bridges are gone
+  std::map<std::string, size_t> mux_owners;
+
+  static void pin(pthread_t thread, size_t shard, const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+      return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[shard % cpus.size()], &set);
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err != 0) {
+      fprintf(stderr, "Failed to pin shard %zu to cpu %d: %s\n", shard, cpus[shard % cpus.size()], strerror(err));
+    }
+  }
+};
+
+// serves snapshots of all runners' counters in the Prometheus text format, one per connection
+class MetricsServer {
+ public:
+  MetricsServer(Shards &shards, const char *path) : shards(shards) {
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      perror("socket");
       exit(1);
     }
 
-    if (sizeof(dst) != res->ai_addrlen) {
-      fprintf(stderr, "Wrong address size %ld != %ld\n", sizeof(dst.sin6_addr), res->ai_addrlen);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Metrics socket path too long: '%s'\n", path);
+      exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+      perror(path);
       exit(1);
     }
-    memcpy(&dst, res->ai_addr, res->ai_addrlen);
 
-    freeaddrinfo(res);
+    // a thread of its own, every shard forwards frames and a slow scraper would stall one
+    thread = std::thread([this] { serve(); });
   }
 
-  void read(std::vector<struct can_frame> &frames) override {
-    uint8_t buffer[1024];
-    ssize_t n = ::read(fd, buffer, sizeof(buffer));
-    if (n <= 0) {
-      fprintf(stderr, "read failed %d\n", n);
-      exit(1);
-    }
+  ~MetricsServer() {
+    // wakes the blocked accept
+    shutdown(fd, SHUT_RDWR);
+    thread.join();
+    close(fd);
+  }
 
-    uint16_t count = (buffer[3] << 8) | buffer[4];
-    size_t pos = 5;
-    while (pos < n) {
-      uint32_t id = (buffer[pos] << 24) | (buffer[pos + 1] << 16) |
-                    (buffer[pos + 2] << 8) | buffer[pos + 3];
-      uint8_t len = buffer[pos + 4];
+ private:
+  Shards &shards;
+  int fd;
+  std::thread thread;
 
-      struct can_frame frame;
-      frame.can_id = id;
-      frame.can_dlc = len;
-      pos += 5;
-      for (int i = 0; i < len; i++) {
-        frame.data[i] = buffer[pos++];
+  void serve() {
+    for (;;) {
+      int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        return;
       }
 
-      frames.emplace_back(frame);
-      count--;
-    }
+      // a stalled reader must not hold up the next scrape
+      struct timeval timeout = {0, 100000};
+      setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-    if (count != 0) {
-      fprintf(stderr, "frames %d missing\n", count);
+      std::string text = render();
+      for (size_t pos = 0; pos < text.size();) {
+        ssize_t n = ::write(client, text.data() + pos, text.size() - pos);
+        if (n <= 0) {
+          break;
+        }
+        pos += n;
+      }
+      close(client);
     }
   }
 
-  void write(std::vector<struct can_frame> &frames) override {
-    uint8_t tx[128];
-    size_t pos = 0;
-    tx[pos++] = 2;  // version
-    tx[pos++] = 0;  // data
-    tx[pos++] = 0;  // seq
-    tx[pos++] = 0;
-    tx[pos++] = 1;
+  struct EndpointSample {
+    uint64_t values[10];
+    uint64_t latency[LATENCY_BUCKETS];
+    uint64_t latency_sum;
+    int64_t clock_offset;
+    int64_t clock_round_trip;
+    uint64_t clock_error[LATENCY_BUCKETS];
+    uint64_t clock_error_sum;
 
-    for (const can_frame &frame : frames) {
-      uint32_t canid = htonl(frame.can_id);
-      memcpy(&tx[pos], &canid, 4);
-      pos += 4;
+    uint64_t operator[](size_t field) const {
+      return values[field];
+    }
+  };
+
+  struct BridgeSample {
+    char name[IF_NAMESIZE + 1];
+    size_t shard;
+    EndpointSample can;
+    EndpointSample udp;
+  };
 
-      tx[pos++] = frame.can_dlc;
-      memcpy(&tx[pos], frame.data, frame.can_dlc);
-      pos += frame.can_dlc;
+  enum { RX_FRAMES,
+         RX_BYTES,
+         TX_FRAMES,
+         TX_BYTES,
+         RX_DATAGRAMS,
+         TX_DATAGRAMS,
+         DROPS,
+         SEQ_GAPS,
+         FAULTS,
+         SEND_ERRORS };
+
+  static void read_endpoint(const EndpointStats &stats, EndpointSample &sample) {
+    const Counter *counters[] = {&stats.rx_frames, &stats.rx_bytes, &stats.tx_frames, &stats.tx_bytes,
+                                 &stats.rx_datagrams, &stats.tx_datagrams, &stats.drops, &stats.seq_gaps, &stats.faults, &stats.send_errors};
+    for (size_t i = 0; i < 10; i++) {
+      sample.values[i] = counters[i]->get();
+    }
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+      sample.latency[i] = stats.latency.buckets[i].get();
+      sample.clock_error[i] = stats.clock_error.buckets[i].get();
     }
+    sample.latency_sum = stats.latency.sum.get();
+    sample.clock_offset = stats.clock_offset.get();
+    sample.clock_round_trip = stats.clock_round_trip.get();
+    sample.clock_error_sum = stats.clock_error.sum.get();
+  }
 
-    ssize_t n = sendto(fd, tx, pos, 0, (struct sockaddr *)&dst, sizeof(dst));
-    if (n != pos) {
-      perror("UDP sendto failed");
-      exit(1);
+  // false if the slot is unused or changed its bridge while being read
+  static bool read_bridge(const BridgeStats &stats, BridgeSample &sample) {
+    uint32_t version = stats.version.load(std::memory_order_acquire);
+    if (version & 1) {
+      return false;
     }
+
+    uint64_t words[IF_NAMESIZE / sizeof(uint64_t)];
+    for (size_t i = 0; i < IF_NAMESIZE / sizeof(uint64_t); i++) {
+      words[i] = stats.name[i].load(std::memory_order_relaxed);
+    }
+    memcpy(sample.name, words, IF_NAMESIZE);
+    sample.name[IF_NAMESIZE] = '\0';
+    read_endpoint(stats.can, sample.can);
+    read_endpoint(stats.udp, sample.udp);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return sample.name[0] && stats.version.load(std::memory_order_relaxed) == version;
   }
 
- private:
-  struct sockaddr_in6 dst;
-};
+  static void appendf(std::string &out, const char *fmt, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    out += line;
+  }
 
-struct Bridge {
-  Bridge() = default;
-  Bridge(const std::shared_ptr<Endpoint> &rx, const std::shared_ptr<Endpoint> &tx) : rx(rx), tx(tx) {}
+  static void family(std::string &out, const char *name, const char *type, const char *help) {
+    appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  }
 
-  std::shared_ptr<Endpoint> rx;
-  std::shared_ptr<Endpoint> tx;
-};
+  // HDR histograms are reported as summaries, their quantiles are exact to a bucket
+  static void summary(std::string &out, const char *name, const char *labels, const uint64_t (&buckets)[LATENCY_BUCKETS], uint64_t sum) {
+    uint64_t count = 0;
+    for (uint64_t n : buckets) {
+      count += n;
+    }
 
-class Runner {
- public:
-  Runner() {
-    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-    if (epoll_fd < 0) {
-      perror("epoll_create1");
-      exit(1);
+    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+      uint64_t rank = q * count;
+      uint64_t seen = 0;
+      size_t bucket = 0;
+      for (; bucket + 1 < LATENCY_BUCKETS; bucket++) {
+        seen += buckets[bucket];
+        if (seen > rank) {
+          break;
+        }
+      }
+      if (count) {
+        appendf(out, "%s{%s,quantile=\"%g\"} %g\n", name, labels, q, LatencyHistogram::upper(bucket) * 1e-9);
+      } else {
+        appendf(out, "%s{%s,quantile=\"%g\"} NaN\n", name, labels, q);
+      }
+    }
+    appendf(out, "%s_sum{%s} %g\n", name, labels, sum * 1e-9);
+    appendf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)count);
+  }
+
+  template <size_t N>
+  static void histogram(std::string &out, const char *name, size_t shard, const Histogram<N> &h, double scale) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < N; i++) {
+      count += h.buckets[i].get();
+      if (i + 1 < N) {
+        appendf(out, "%s_bucket{shard=\"%zu\",le=\"%g\"} %llu\n", name, shard, (double)(1ull << i) * scale, (unsigned long long)count);
+      } else {
+        appendf(out, "%s_bucket{shard=\"%zu\",le=\"+Inf\"} %llu\n", name, shard, (unsigned long long)count);
+      }
     }
+    appendf(out, "%s_sum{shard=\"%zu\"} %g\n", name, shard, h.sum.get() * scale);
+    appendf(out, "%s_count{shard=\"%zu\"} %llu\n", name, shard, (unsigned long long)count);
   }
 
-  void add(const char *canif_name, const char *addr, uint16_t port) {
-    printf("Bridging %s <-> %s:%d\n", canif_name, addr, port);
-    auto can = std::make_shared<CANEndpoint>(canif_name);
-    auto udp = std::make_shared<UDPEndpoint>(addr, port);
+  std::string render() {
+    std::vector<BridgeSample> samples;
+    const std::vector<std::unique_ptr<Runner>> &runners = shards.get_runners();
+    for (size_t shard = 0; shard < runners.size(); shard++) {
+      for (const BridgeStats &stats : runners[shard]->get_bridge_stats()) {
+        BridgeSample sample;
+        sample.shard = shard;
+        if (read_bridge(stats, sample)) {
+          samples.push_back(sample);
+        }
+      }
+    }
+
+    std::string out;
+    auto per_bridge = [&](const char *name, const char *type, const char *help, const char *label,
+                          const char *can_value, const char *udp_value, size_t can_field, size_t udp_field) {
+      family(out, name, type, help);
+      for (const BridgeSample &b : samples) {
+        appendf(out, "%s{bridge=\"%s\",%s=\"%s\"} %llu\n", name, b.name, label, can_value, (unsigned long long)b.can[can_field]);
+        appendf(out, "%s{bridge=\"%s\",%s=\"%s\"} %llu\n", name, b.name, label, udp_value, (unsigned long long)b.udp[udp_field]);
+      }
+    };
+
+    per_bridge("cannelloni_frames_total", "counter", "Frames received per direction.",
+               "direction", "can_to_udp", "udp_to_can", RX_FRAMES, RX_FRAMES);
+    per_bridge("cannelloni_bytes_total", "counter", "CAN payload bytes received per direction.",
+               "direction", "can_to_udp", "udp_to_can", RX_BYTES, RX_BYTES);
+    per_bridge("cannelloni_frames_sent_total", "counter", "Frames written per endpoint.",
+               "endpoint", "can", "udp", TX_FRAMES, TX_FRAMES);
+    per_bridge("cannelloni_drops_total", "counter", "Frames dropped on the way to the endpoint.",
+               "endpoint", "can", "udp", DROPS, DROPS);
+    per_bridge("cannelloni_endpoint_faults_total", "counter", "Endpoint failures that required a reopen.",
+               "endpoint", "can", "udp", FAULTS, FAULTS);
+    per_bridge("cannelloni_send_errors_total", "counter", "Writes the kernel failed, their frames count as drops.",
+               "endpoint", "can", "udp", SEND_ERRORS, SEND_ERRORS);
+
+    family(out, "cannelloni_datagrams_total", "counter", "Cannelloni datagrams received and sent.");
+    for (const BridgeSample &b : samples) {
+      appendf(out, "cannelloni_datagrams_total{bridge=\"%s\",direction=\"rx\"} %llu\n", b.name, (unsigned long long)b.udp[RX_DATAGRAMS]);
+      appendf(out, "cannelloni_datagrams_total{bridge=\"%s\",direction=\"tx\"} %llu\n", b.name, (unsigned long long)b.udp[TX_DATAGRAMS]);
+    }
+
+    family(out, "cannelloni_sequence_gaps_total", "counter", "Datagrams missing according to the sequence numbers.");
+    for (const BridgeSample &b : samples) {
+      appendf(out, "cannelloni_sequence_gaps_total{bridge=\"%s\"} %llu\n", b.name, (unsigned long long)b.udp[SEQ_GAPS]);
+    }
+
+    family(out, "cannelloni_latency_seconds", "summary", "Time from the kernel receiving a frame until the bridge sent it on.");
+    for (const BridgeSample &b : samples) {
+      char labels[64];
+      snprintf(labels, sizeof(labels), "bridge=\"%s\",direction=\"can_to_udp\"", b.name);
+      summary(out, "cannelloni_latency_seconds", labels, b.udp.latency, b.udp.latency_sum);
+      snprintf(labels, sizeof(labels), "bridge=\"%s\",direction=\"udp_to_can\"", b.name);
+      summary(out, "cannelloni_latency_seconds", labels, b.can.latency, b.can.latency_sum);
+    }
+
+    family(out, "cannelloni_clock_offset_seconds", "gauge", "Gateway clock minus the bridge's at the last clock exchange.");
+    for (const BridgeSample &b : samples) {
+      appendf(out, "cannelloni_clock_offset_seconds{bridge=\"%s\"} %g\n", b.name, b.udp.clock_offset * 1e-9);
+    }
+    family(out, "cannelloni_clock_round_trip_seconds", "gauge", "Network round trip of the last clock exchange, the offset is uncertain by half of it.");
+    for (const BridgeSample &b : samples) {
+      appendf(out, "cannelloni_clock_round_trip_seconds{bridge=\"%s\"} %g\n", b.name, b.udp.clock_round_trip * 1e-9);
+    }
+    family(out, "cannelloni_clock_error_seconds", "summary", "How far off the gateway's synchronised clock was per clock exchange.");
+    for (const BridgeSample &b : samples) {
+      char labels[64];
+      snprintf(labels, sizeof(labels), "bridge=\"%s\"", b.name);
+      summary(out, "cannelloni_clock_error_seconds", labels, b.udp.clock_error, b.udp.clock_error_sum);
+    }
 
-    fds[can->get_fd()] = Bridge(can, udp);
-    fds[udp->get_fd()] = Bridge(udp, can);
+    family(out, "cannelloni_batch_frames", "histogram", "Frames moved between endpoints at once.");
+    for (size_t shard = 0; shard < runners.size(); shard++) {
+      histogram(out, "cannelloni_batch_frames", shard, runners[shard]->get_stats().batch_frames, 1);
+    }
+    family(out, "cannelloni_loop_duration_seconds", "histogram", "Time spent handling one event loop wakeup.");
+    for (size_t shard = 0; shard < runners.size(); shard++) {
+      histogram(out, "cannelloni_loop_duration_seconds", shard, runners[shard]->get_stats().loop_ns, 1e-9);
+    }
+    return out;
+  }
+};
 
-    add_epoll(can->get_fd());
-    add_epoll(udp->get_fd());
+// CAN filters per bridge name, explicit ones win over the ones gateways announce in TXT records
+class Filters {
+ public:
+  // "<name>=<filter>" applies to one bridge, a bare filter to all bridges without their own
+  void add(const char *arg) {
+    const char *eq = strchr(arg, '=');
+    std::string name = eq ? std::string(arg, eq - arg) : "*";
+    set(name, eq ? eq + 1 : arg, arg);
   }
 
-  void run() {
-    std::vector<struct can_frame> frames;
-    const size_t max_events = 16;
-    for (;;) {
-      struct epoll_event evts[max_events];
-      int nfds = epoll_wait(epoll_fd, evts, max_events, -1);
-      if (nfds == -1) {
-        perror("epoll_wait");
+  // one "<name> <filter>" per line, "*" names the default, lines starting with '#' are comments
+  void load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+      perror(path);
+      exit(1);
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+      char name[IF_NAMESIZE + 1];
+      char spec[sizeof(line)];
+      int fields = sscanf(line, " %16s %511s", name, spec);
+      if (fields <= 0 || name[0] == '#') {
+        continue;
+      }
+      if (fields != 2) {
+        fprintf(stderr, "%s: invalid line '%s'\n", path, line);
         exit(1);
       }
+      set(name, spec, line);
+    }
+    fclose(f);
+  }
 
-      for (size_t i = 0; i < nfds; i++) {
-        auto &tunnel = fds[evts[i].data.fd];
+  CANFilter lookup(const char *name, const char *announced) const {
+    if (auto it = named.find(name); it != named.end()) {
+      return it->second;
+    }
 
-        frames.clear();
-        tunnel.rx->read(frames);
-        tunnel.tx->write(frames);
+    CANFilter filter;
+    if (announced) {
+      if (parse_filter(announced, filter)) {
+        return filter;
       }
+      fprintf(stderr, "%s: ignoring invalid announced filter '%s'\n", name, announced);
     }
+
+    auto it = named.find("*");
+    return it != named.end() ? it->second : CANFilter{};
   }
 
  private:
-  int epoll_fd;
-  std::map<int, Bridge> fds;
+  std::map<std::string, CANFilter> named;
 
-  void add_epoll(int fd) {
-    struct epoll_event evt = {0};
-    evt.events = EPOLLIN;
-    evt.data.fd = fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &evt) == -1) {
-      perror("epoll_ctl");
+  void set(const std::string &name, const char *spec, const char *origin) {
+    if (!parse_filter(spec, named[name])) {
+      fprintf(stderr, "Invalid filter: '%s'\n", origin);
       exit(1);
     }
   }
@@ -265,15 +3316,9 @@ class Runner {
 
 class Discovery {
  public:
-  Discovery(Runner &runner) : runner(runner) {
-    AvahiSimplePoll *simple_poll = avahi_simple_poll_new();
-    if (!simple_poll) {
-      fprintf(stderr, "Failed to create simple poll object.\n");
-      exit(1);
-    }
-
+  Discovery(Shards &shards, const Filters &filters) : shards(shards), filters(filters) {
     int error = 0;
-    client = avahi_client_new(avahi_simple_poll_get(simple_poll), (AvahiClientFlags)0, NULL, NULL, &error);
+    client = avahi_client_new(shards.control().get_avahi_poll(), (AvahiClientFlags)0, NULL, NULL, &error);
     if (!client) {
       fprintf(stderr, "Failed to create client: %s\n", avahi_strerror(error));
       exit(1);
@@ -284,13 +3329,11 @@ class Discovery {
       fprintf(stderr, "Failed to create service browser: %s\n", avahi_strerror(avahi_client_errno(client)));
       exit(1);
     }
-
-    avahi_thread = std::thread([simple_poll] { avahi_simple_poll_loop(simple_poll); });
   }
 
   static void resolve_callback(
       AvahiServiceResolver *r,
-      AVAHI_GCC_UNUSED AvahiIfIndex interface,
+      AvahiIfIndex interface,
       AVAHI_GCC_UNUSED AvahiProtocol protocol,
       AvahiResolverEvent event,
       const char *name,
@@ -318,16 +3361,103 @@ class Discovery {
           exit(1);
         }
 
-        std::stringstream ss;
-        ss << address_str << '%' << ifname;
+        Command cmd = {Command::ADD};
+        snprintf(cmd.name, sizeof(cmd.name), "%s", name);
+        snprintf(cmd.addr, sizeof(cmd.addr), "%s%%%s", address_str, ifname);
+        cmd.port = port;
+
+        // multiplexing gateways announce the shared port and which channel the service is
+        std::string mux_port = txt_value(txt, "mux");
+        std::string channel = txt_value(txt, "channel");
+        if (!mux_port.empty() && !channel.empty()) {
+          cmd.mux = {(uint16_t)atoi(mux_port.c_str()), (uint8_t)atoi(channel.c_str())};
+        }
+        cmd.transport = txt_value(txt, "transport") == "eth" ? Transport::ETH : Transport::UDP;
+        cmd.fd_frames = txt_value(txt, "fd") == "1";
+
+        std::string announced = txt_value(txt, "filter");
+        cmd.filter = discovery->filters.lookup(name, announced.empty() ? nullptr : announced.c_str());
 
-        discovery->runner.add(name, ss.str().c_str(), port);
+        discovery->on_service_resolved(name, interface, cmd);
       }
     }
 
     avahi_service_resolver_free(r);
   }
 
+  // value of a key=value TXT record, empty when there is none
+  static std::string txt_value(AvahiStringList *txt, const char *key) {
+    std::string value;
+    char *text = nullptr;
+    if (AvahiStringList *item = avahi_string_list_find(txt, key)) {
+      avahi_string_list_get_pair(item, nullptr, &text, nullptr);
+    }
+    if (text) {
+      value = text;
+      avahi_free(text);
+    }
+    return value;
+  }
+
+  void on_service_new(const char *name, AvahiIfIndex interface) {
+    std::vector<Instance> &seen = instances[name];
+    if (!find(seen, interface)) {
+      seen.push_back({interface});
+    }
+  }
+
+  // the bridge follows one interface's instance, others only stand by, so it never bounces between them
+  void on_service_resolved(const char *name, AvahiIfIndex interface, const Command &cmd) {
+    auto it = instances.find(name);
+    Instance *instance = it == instances.end() ? nullptr : find(it->second, interface);
+    if (!instance) {
+      return;
+    }
+    instance->resolved = true;
+    instance->cmd = cmd;
+
+    Instance *current = active(it->second);
+    if (!current) {
+      instance->active = true;
+      current = instance;
+    }
+    if (current == instance) {
+      shards.submit(cmd);
+    }
+  }
+
+  // services are reported per interface, the bridge moves to another one when its own goes away
+  // and is removed with the last one
+  void on_service_remove(const char *name, AvahiIfIndex interface) {
+    auto it = instances.find(name);
+    Instance *instance = it == instances.end() ? nullptr : find(it->second, interface);
+    if (!instance) {
+      return;
+    }
+    bool was_active = instance->active;
+    it->second.erase(it->second.begin() + (instance - it->second.data()));
+
+    if (it->second.empty()) {
+      instances.erase(it);
+      Command cmd = {Command::REMOVE};
+      snprintf(cmd.name, sizeof(cmd.name), "%s", name);
+      shards.submit(cmd);
+      return;
+    }
+
+    if (!was_active) {
+      return;
+    }
+    // one still resolving takes over once it resolves
+    for (Instance &other : it->second) {
+      if (other.resolved) {
+        other.active = true;
+        shards.submit(other.cmd);
+        return;
+      }
+    }
+  }
+
   static void browse_callback(
       AvahiServiceBrowser *b,
       AvahiIfIndex interface,
@@ -338,31 +3468,162 @@ class Discovery {
       const char *domain,
       AvahiLookupResultFlags flags,
       void *userdata) {
+    Discovery *discovery = static_cast<Discovery *>(userdata);
     switch (event) {
       case AVAHI_BROWSER_FAILURE:
         fprintf(stderr, "Browser failure: %s\n", avahi_strerror(avahi_client_errno(avahi_service_browser_get_client(b))));
         break;
 
       case AVAHI_BROWSER_NEW:
-        Discovery *discovery = static_cast<Discovery *>(userdata);
+        discovery->on_service_new(name, interface);
         if (!(avahi_service_resolver_new(discovery->client, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, (AvahiLookupFlags)0, resolve_callback, discovery))) {
           fprintf(stderr, "Failed to resolve service '%s': %s\n", name, avahi_strerror(avahi_client_errno(discovery->client)));
         }
         break;
+
+      case AVAHI_BROWSER_REMOVE:
+        discovery->on_service_remove(name, interface);
+        break;
+
+      case AVAHI_BROWSER_CACHE_EXHAUSTED:
+      case AVAHI_BROWSER_ALL_FOR_NOW:
+        break;
     }
   }
 
  private:
+  // a service as announced on one interface
+  struct Instance {
+    AvahiIfIndex interface;
+    bool resolved = false;
+    // the bridge points at this one
+    bool active = false;
+    Command cmd = {};
+  };
+
   AvahiClient *client;
-  std::thread avahi_thread;
-  Runner &runner;
+  Shards &shards;
+  const Filters &filters;
+  std::map<std::string, std::vector<Instance>> instances;
+
+  static Instance *find(std::vector<Instance> &seen, AvahiIfIndex interface) {
+    for (Instance &instance : seen) {
+      if (instance.interface == interface) {
+        return &instance;
+      }
+    }
+    return nullptr;
+  }
+
+  static Instance *active(std::vector<Instance> &seen) {
+    for (Instance &instance : seen) {
+      if (instance.active) {
+        return &instance;
+      }
+    }
+    return nullptr;
+  }
 };
 
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-b epoll|io_uring] [-o drop-oldest|drop-newest|coalesce] [-m metrics.sock] [-f [name=]filter]... [-F filters.conf] [-t threads] [-c cpu,...] [-e] [canif:addr:port[,mux=port,channel=n][,fd=1]]...\n", prog);
+  exit(1);
+}
+
+static std::vector<int> parse_cpus(const char *list) {
+  std::vector<int> cpus;
+  char *end;
+  for (const char *p = list; *p; p = end) {
+    cpus.push_back(strtol(p, &end, 10));
+    if (end == p || (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "Invalid cpu list: '%s'\n", list);
+      exit(1);
+    }
+    if (*end == ',') {
+      end++;
+    }
+  }
+  return cpus;
+}
+
 int main(int argc, char **argv) {
-  Runner runner;
-  Discovery discovery(runner);
+  int threads = 1;
+  std::vector<int> cpus;
+  Backend backend = Backend::EPOLL;
+  OverflowPolicy policy = OverflowPolicy::DROP_OLDEST;
+  const char *metrics_path = nullptr;
+  Filters filters;
+  // of the bridges given on the command line, discovered gateways announce theirs
+  Transport transport = Transport::UDP;
+
+  static const struct option options[] = {
+      {"backend", required_argument, nullptr, 'b'},
+      {"overflow", required_argument, nullptr, 'o'},
+      {"metrics", required_argument, nullptr, 'm'},
+      {"filter", required_argument, nullptr, 'f'},
+      {"filter-file", required_argument, nullptr, 'F'},
+      {"threads", required_argument, nullptr, 't'},
+      {"cpus", required_argument, nullptr, 'c'},
+      {"raw-ethernet", no_argument, nullptr, 'e'},
+      {nullptr, 0, nullptr, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:o:m:f:F:t:c:e", options, nullptr)) != -1) {
+    switch (opt) {
+      case 'b':
+        if (strcmp(optarg, "epoll") == 0) {
+          backend = Backend::EPOLL;
+        } else if (strcmp(optarg, "io_uring") == 0) {
+          backend = Backend::IO_URING;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'o':
+        if (strcmp(optarg, "drop-oldest") == 0) {
+          policy = OverflowPolicy::DROP_OLDEST;
+        } else if (strcmp(optarg, "drop-newest") == 0) {
+          policy = OverflowPolicy::DROP_NEWEST;
+        } else if (strcmp(optarg, "coalesce") == 0) {
+          policy = OverflowPolicy::COALESCE;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'm':
+        metrics_path = optarg;
+        break;
+      case 'f':
+        filters.add(optarg);
+        break;
+      case 'F':
+        filters.load(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        if (threads < 1) {
+          usage(argv[0]);
+        }
+        break;
+      case 'c':
+        cpus = parse_cpus(optarg);
+        break;
+      case 'e':
+        transport = Transport::ETH;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  Shards shards(threads, backend, policy);
+  Discovery discovery(shards, filters);
+  std::unique_ptr<MetricsServer> metrics;
+  if (metrics_path) {
+    metrics = std::make_unique<MetricsServer>(shards, metrics_path);
+  }
 
-  for (int i = 1; i < argc; i++) {
+  for (int i = optind; i < argc; i++) {
     char *pos1 = strchr(argv[i], ':');
     char *pos2 = strrchr(argv[i], ':');
     if (!pos1 || !pos2 || pos1 == pos2) {
@@ -371,8 +3632,29 @@ int main(int argc, char **argv) {
     }
     *pos1 = '\0';
     *pos2 = '\0';
-    runner.add(argv[i], pos1 + 1, atoi(pos2 + 1));
+
+    Command cmd = {Command::ADD};
+    snprintf(cmd.name, sizeof(cmd.name), "%s", argv[i]);
+    snprintf(cmd.addr, sizeof(cmd.addr), "%s", pos1 + 1);
+    cmd.port = atoi(pos2 + 1);
+    // ,mux=<port>,channel=<n>,fd=1 after the port, like the TXT records of the gateway
+    for (char *opt = strchr(pos2 + 1, ','); opt; opt = strchr(opt + 1, ',')) {
+      if (strncmp(opt + 1, "fd=", 3) == 0) {
+        cmd.fd_frames = atoi(opt + 4) == 1;
+      } else if (strncmp(opt + 1, "mux=", 4) == 0) {
+        cmd.mux.port = atoi(opt + 5);
+      } else if (strncmp(opt + 1, "channel=", 8) == 0) {
+        cmd.mux.channel = atoi(opt + 9);
+      } else {
+        fprintf(stderr, "Invalid bridge option: '%s'\n", opt + 1);
+        exit(1);
+      }
+    }
+    cmd.transport = transport;
+    cmd.filter = filters.lookup(cmd.name, nullptr);
+    shards.submit(cmd);
   }
 
-  runner.run();
+  shards.run(cpus);
+  return 0;
 }
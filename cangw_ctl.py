@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Reads and changes per-channel settings of a gateway over its control port."""
+import argparse
+import ipaddress
+import socket
+import struct
+
+CONTROL_PORT = 19999
+VERSION = 1
+GET, SET = 0, 1
+REPLY = 0x80
+STATUS = ['ok', 'bad request', 'bad channel', 'rejected']
+
+BATCH_FRAMES, BATCH_TIMEOUT, BITRATE, FILTERS, DESTINATIONS, QUEUE_POLICY, EXPRESS, TX_MAX_AGE, TX_COALESCE, TX_EXPIRED, TX_COALESCED, SEND_DROPPED = range(1, 13)
+POLICIES = ['drop-newest', 'drop-oldest']
+EXTENDED = 1 << 31
+
+
+def param(kind, value):
+    return struct.pack('BB', kind, len(value)) + value
+
+
+def parse_filter(text):
+    id, mask = text.split(':')
+    flag = EXTENDED if len(id) == 8 else 0
+    return struct.pack('>II', int(id, 16) | flag, int(mask, 16))
+
+
+def parse_destination(text):
+    addr, port = text.rsplit(':', 1)
+    return ipaddress.IPv6Address(addr.strip('[]')).packed + struct.pack('>H', int(port))
+
+
+def build_params(args):
+    params = b''
+    if args.batch_frames is not None:
+        params += param(BATCH_FRAMES, struct.pack('>H', args.batch_frames))
+    if args.batch_timeout is not None:
+        params += param(BATCH_TIMEOUT, struct.pack('>H', args.batch_timeout))
+    if args.bitrate is not None:
+        params += param(BITRATE, struct.pack('>IH', args.bitrate, args.sample_point))
+    if args.filter is not None:
+        params += param(FILTERS, b''.join(parse_filter(f) for f in args.filter))
+    if args.destination is not None:
+        params += param(DESTINATIONS, b''.join(parse_destination(d) for d in args.destination))
+    if args.policy is not None:
+        params += param(QUEUE_POLICY, bytes([POLICIES.index(args.policy)]))
+    if args.express is not None:
+        params += param(EXPRESS, b''.join(parse_filter(f) for f in args.express))
+    if args.max_age is not None:
+        params += param(TX_MAX_AGE, struct.pack('>H', args.max_age))
+    if args.coalesce is not None:
+        params += param(TX_COALESCE, bytes([args.coalesce == 'on']))
+    return params
+
+
+def print_params(data):
+    pos = 0
+    while pos + 2 <= len(data):
+        kind, length = data[pos], data[pos + 1]
+        value = data[pos + 2:pos + 2 + length]
+        pos += 2 + length
+        if kind == BATCH_FRAMES:
+            print(f"batch frames:  {struct.unpack('>H', value)[0]}")
+        elif kind == BATCH_TIMEOUT:
+            print(f"batch timeout: {struct.unpack('>H', value)[0]} ms")
+        elif kind == BITRATE:
+            bitrate, sample_point = struct.unpack('>IH', value)
+            print(f"bitrate:       {bitrate} bit/s" + (f" @ {sample_point / 10}%" if sample_point else ''))
+        elif kind in (FILTERS, EXPRESS):
+            filters = [struct.unpack('>II', value[i:i + 8]) for i in range(0, len(value), 8)]
+            label = 'filters:' if kind == FILTERS else 'express:'
+            print(f"{label:15}" + (', '.join(f"{id & ~EXTENDED:x}:{mask:x}" for id, mask in filters) or 'none'))
+        elif kind == DESTINATIONS:
+            dsts = [value[i:i + 18] for i in range(0, len(value), 18)]
+            print('destinations:  ' + (', '.join(f"[{ipaddress.IPv6Address(d[:16])}]:{struct.unpack('>H', d[16:])[0]}" for d in dsts) or 'multicast'))
+        elif kind == QUEUE_POLICY:
+            print(f"queue policy:  {POLICIES[value[0]]}")
+        elif kind == TX_MAX_AGE:
+            max_age = struct.unpack('>H', value)[0]
+            print(f"max age:       {f'{max_age} ms' if max_age else 'none'}")
+        elif kind == TX_COALESCE:
+            print(f"coalesce:      {'on' if value[0] else 'off'}")
+        elif kind == TX_EXPIRED:
+            print(f"expired:       {struct.unpack('>I', value)[0]} frames")
+        elif kind == TX_COALESCED:
+            print(f"coalesced:     {struct.unpack('>I', value)[0]} frames")
+        elif kind == SEND_DROPPED:
+            print(f"send dropped:  {struct.unpack('>I', value)[0]} frames")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('gateway', help='link-local address of the gateway, e.g. fe80::1%%eth0')
+    parser.add_argument('channel', type=int)
+    parser.add_argument('--batch-frames', type=int, help='frames queued before a datagram is sent')
+    parser.add_argument('--batch-timeout', type=int, help='ms the oldest frame may wait for more')
+    parser.add_argument('--bitrate', type=int)
+    parser.add_argument('--sample-point', type=int, default=0, help='per mille, CiA default when omitted')
+    parser.add_argument('--filter', nargs='*', metavar='ID:MASK', help='hex acceptance filters, none passes all frames')
+    parser.add_argument('--destination', nargs='*', metavar='ADDR:PORT', help='unicast destinations, none restores multicast')
+    parser.add_argument('--policy', choices=POLICIES)
+    parser.add_argument('--max-age', type=int, help='ms a frame for the bus may be queued, 0 for no limit')
+    parser.add_argument('--coalesce', choices=['on', 'off'], help='a frame for the bus replaces the queued one with its ID')
+    parser.add_argument('--express', nargs='*', metavar='ID:MASK', help='hex matches of frames sent without batching')
+    args = parser.parse_args()
+
+    params = build_params(args)
+    request = struct.pack('BBBB', VERSION, SET if params else GET, 0, args.channel) + params
+
+    addr = socket.getaddrinfo(args.gateway, CONTROL_PORT, socket.AF_INET6, socket.SOCK_DGRAM)[0][4]
+    with socket.socket(socket.AF_INET6, socket.SOCK_DGRAM) as sock:
+        sock.settimeout(1)
+        sock.sendto(request, addr)
+        reply = sock.recv(512)
+
+    if len(reply) < 5 or reply[1] != request[1] | REPLY:
+        raise SystemExit('unexpected reply')
+    if reply[4] != 0:
+        print(f"error: {STATUS[reply[4]] if reply[4] < len(STATUS) else reply[4]}")
+    print_params(reply[5:])
+    raise SystemExit(reply[4])
+
+
+if __name__ == '__main__':
+    main()
@@ -22,50 +22,101 @@
 #include <stdlib.h>
 #include <string.h>
 #include "udp.h"
+#include "sys.h"
+#include "netif/ethernet.h"
 #include "cannelloni.h"
 
+/* Channels served by cannelloni_eth_input, looked up by port */
+static cannelloni_handle_t *eth_channels[CNL_ETH_MAX_CHANNELS];
+static uint8_t eth_channel_count;
+
+/* Orders the frames in the slots against the index that hands them over */
+#ifdef __TI_ARM__
+#define QUEUE_BARRIER() __asm(" dmb")
+#else
+#define QUEUE_BARRIER() __sync_synchronize()
+#endif
+
 static void queue_init(frames_queue_t *q, struct canfd_frame *frames, size_t count) {
+  /* Indices are masked, slots past the largest power of two stay unused */
+  uint32_t size = 1;
+  while (size * 2 <= count) {
+    size *= 2;
+  }
+
   q->head = 0;
   q->tail = 0;
-  q->count = count;
+  q->mask = size - 1;
   q->frames = frames;
 }
 
-static struct canfd_frame *queue_put(frames_queue_t *q) {
-  if ((q->tail + 1) % q->count == q->head) {
-    return NULL;
-  }
+static struct canfd_frame *queue_slot(frames_queue_t *q, uint32_t index) {
+  return &(q->frames[index & q->mask]);
+}
 
-  struct canfd_frame *frame = &(q->frames[q->tail]);
-  q->tail = (q->tail + 1) % q->count;
-  return frame;
+/* Frames queued, at most a full ring even when the producer lapped the consumer */
+static uint32_t queue_size(frames_queue_t *q) {
+  uint32_t size = q->tail - q->head;
+  return size > q->mask ? q->mask + 1 : size;
 }
 
-static struct canfd_frame *queue_take(frames_queue_t *q) {
-  if (q->head == q->tail) {
-    return NULL;
-  }
+/* Producer: how many of n slots from the tail on may be filled. With overwrite up to a full ring,
+ * the slots past the free ones replace the oldest frames. */
+static uint32_t queue_reserve(frames_queue_t *q, uint32_t n, bool overwrite) {
+  uint32_t free = overwrite ? q->mask + 1 : q->mask + 1 - queue_size(q);
+  /* The consumer is done with the slots it released */
+  QUEUE_BARRIER();
+  return n < free ? n : free;
+}
 
-  struct canfd_frame *frame = &(q->frames[q->head]);
-  q->head = (q->head + 1) % q->count;
-  return frame;
+/* Producer: hands the first n reserved slots to the consumer */
+static void queue_commit(frames_queue_t *q, uint32_t n) {
+  QUEUE_BARRIER();
+  q->tail += n;
 }
 
-static struct canfd_frame *queue_peek(frames_queue_t *q) {
-  if (q->head == q->tail) {
-    return NULL;
+/* Consumer: how many of n frames from the head on may be read, skipping the ones overwritten */
+static uint32_t queue_acquire(frames_queue_t *q, uint32_t n) {
+  uint32_t tail = q->tail;
+  if (tail - q->head > q->mask + 1) {
+    q->head = tail - (q->mask + 1);
   }
+  QUEUE_BARRIER();
+  uint32_t size = tail - q->head;
+  return n < size ? n : size;
+}
+
+/* Consumer: whether the frame at index is still the one acquired, the producer may overwrite it meanwhile */
+static bool queue_intact(frames_queue_t *q, uint32_t index) {
+  QUEUE_BARRIER();
+  return q->tail - index <= q->mask + 1;
+}
 
-  return &(q->frames[q->head]);
+/* Consumer: frees the first n acquired frames */
+static void queue_release(frames_queue_t *q, uint32_t n) {
+  QUEUE_BARRIER();
+  q->head += n;
 }
 
 void init_cannelloni(cannelloni_handle_t *handle) {
   handle->sequence_number = 0;
   handle->udp_rx_count = 0;
+  handle->express_pending = false;
+  handle->tx_expired = 0;
+  handle->tx_coalesced = 0;
+  memset(&handle->retry, 0, sizeof(handle->retry));
+  memset(&handle->time_exchange, 0, sizeof(handle->time_exchange));
 
   queue_init(&handle->tx_queue, handle->Init.can_tx_buf, handle->Init.can_buf_size);
   queue_init(&handle->rx_queue, handle->Init.can_rx_buf, handle->Init.can_buf_size);
 
+  if (handle->Init.transport == CNL_TRANSPORT_ETH) {
+    if (eth_channel_count < CNL_ETH_MAX_CHANNELS) {
+      eth_channels[eth_channel_count++] = handle;
+    }
+    return;
+  }
+
   handle->udp_pcb = udp_new();
   if (handle->udp_pcb == NULL) {
     return;
@@ -76,68 +127,175 @@ void init_cannelloni(cannelloni_handle_t *handle) {
   udp_recv(handle->udp_pcb, handle_cannelloni_frame, (void *)handle);
 }
 
+static bool is_express(cannelloni_handle_t *handle, canid_t can_id) {
+  for (uint8_t i = 0; i < handle->Init.express_count; i++) {
+    const struct cnl_id_match *match = &handle->Init.express[i];
+    if ((can_id & CAN_EFF_FLAG) == (match->id & CAN_EFF_FLAG) && ((can_id ^ match->id) & match->mask & CAN_EFF_MASK) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Looks for express frames among the received ones queued from first on */
+static void mark_express(cannelloni_handle_t *handle, uint32_t first) {
+  frames_queue_t *q = &handle->rx_queue;
+  if (q->tail - first > q->mask + 1) {
+    first = q->tail - (q->mask + 1);
+  }
+  for (uint32_t i = first; i != q->tail && !handle->express_pending; i++) {
+    handle->express_pending = is_express(handle, queue_slot(q, i)->can_id);
+  }
+}
+
+/* Frames for the bus are decoded into slots reserved behind the tail of tx_queue */
+struct tx_reservation {
+  uint32_t slots;
+  uint32_t used;
+};
+
+/* Slot for a frame to the bus: with coalescing the queued or reserved one of the same ID, which the
+ * new payload replaces in place, otherwise the next reserved slot */
+static struct canfd_frame *reserve_tx(cannelloni_handle_t *handle, struct tx_reservation *r, canid_t can_id) {
+  frames_queue_t *q = &handle->tx_queue;
+  if (handle->Init.tx_coalesce) {
+    /* Not the head, it may be on its way to the controller, nor frames the reservation overwrote */
+    uint32_t end = q->tail + r->used;
+    uint32_t first = q->head + (q->tail != q->head);
+    if ((int32_t)(end - (q->mask + 1) - first) > 0) {
+      first = end - (q->mask + 1);
+    }
+    for (uint32_t i = first; (int32_t)(end - i) > 0; i++) {
+      struct canfd_frame *frame = queue_slot(q, i);
+      if (frame->can_id == can_id) {
+        handle->tx_coalesced++;
+        return frame;
+      }
+    }
+  }
+
+  if (r->used == r->slots) {
+    return NULL;
+  }
+  return queue_slot(q, q->tail + r->used++);
+}
+
+/* Reads a datagram across the segments of a pbuf chain */
+struct pbuf_cursor {
+  const struct pbuf *p;
+  uint16_t offset;
+  uint16_t left;
+};
+
+static void cursor_init(struct pbuf_cursor *c, const struct pbuf *p) {
+  c->p = p;
+  c->offset = 0;
+  c->left = p->tot_len;
+}
+
+/* Copies the next n bytes to dst, or skips them if dst is NULL; false without moving if fewer are left */
+static bool cursor_read(struct pbuf_cursor *c, void *dst, uint16_t n) {
+  if (n > c->left) {
+    return false;
+  }
+  c->left -= n;
+
+  uint8_t *out = (uint8_t *)dst;
+  while (n) {
+    while (c->offset == c->p->len) {
+      c->p = c->p->next;
+      c->offset = 0;
+    }
+    uint16_t chunk = c->p->len - c->offset < n ? c->p->len - c->offset : n;
+    if (out) {
+      memcpy(out, (const uint8_t *)c->p->payload + c->offset, chunk);
+      out += chunk;
+    }
+    c->offset += chunk;
+    n -= chunk;
+  }
+  return true;
+}
+
+/* Decodes count frames for the bus, straight from the pbuf segments into queue slots reserved at once */
+static void decode_frames(cannelloni_handle_t *handle, struct pbuf_cursor *cursor, uint16_t count) {
+  frames_queue_t *q = &handle->tx_queue;
+  /* The count comes from the network, reserve no more than the payload can hold */
+  uint32_t slots = cursor->left / CANNELLONI_FRAME_BASE_SIZE;
+  if (slots > count) {
+    slots = count;
+  }
+  struct tx_reservation r = {queue_reserve(q, slots, handle->Init.queue_policy == CNL_DROP_OLDEST), 0};
+  uint32_t now = sys_now();
+
+  for (uint16_t i = 0; i < count; i++) {
+    uint8_t header[CANNELLONI_FRAME_BASE_SIZE];
+    if (!cursor_read(cursor, header, sizeof(header))) {
+      /* Received incomplete packet */
+      break;
+    }
+    canid_t can_id = ((canid_t)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+    uint8_t len = header[4];
+
+    /* If this is a CAN FD frame, also retrieve the flags */
+    uint8_t flags = 0;
+    if ((len & CANFD_FRAME) && !cursor_read(cursor, &flags, 1)) {
+      break;
+    }
+    /* RTR Frames have no data section although they have a dlc */
+    uint8_t size = (can_id & CAN_RTR_FLAG) ? 0 : len & ~CANFD_FRAME;
+    if (size > cursor->left) {
+      /* Received incomplete packet / can header corrupt! */
+      break;
+    }
+    if (size > CNL_CANFD_MAX_DLEN || ((len & CANFD_FRAME) && !handle->Init.can_fd)) {
+      /* Longer than our frames hold, or FD on a classic controller */
+      cursor_read(cursor, NULL, size);
+      continue;
+    }
+
+    /* Express frames are built aside and only queued if the controller can't take them */
+    struct canfd_frame direct;
+    bool express = is_express(handle, can_id) && handle->Init.can_tx_fn && !queue_size(q) && !r.used;
+    struct canfd_frame *frame = express ? &direct : reserve_tx(handle, &r, can_id);
+    if (!frame) {
+      /* Queue full, later frames of the datagram may still be coalesced */
+      cursor_read(cursor, NULL, size);
+      continue;
+    }
+    frame->can_id = can_id;
+    frame->len = len;
+    frame->flags = flags;
+    frame->timestamp = now;
+    cursor_read(cursor, frame->data, size);
+
+    if (express && !handle->Init.can_tx_fn(handle, &direct)) {
+      frame = reserve_tx(handle, &r, can_id);
+      if (frame) {
+        *frame = direct;
+      }
+    }
+  }
+
+  /* transmit_can_frames sees the datagram's frames all at once */
+  queue_commit(q, r.used);
+}
+
+static void answer_time_request(cannelloni_handle_t *handle, struct pbuf_cursor *cursor, uint16_t port);
+
 void handle_cannelloni_frame(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, uint16_t port) {
   cannelloni_handle_t *const handle = (cannelloni_handle_t *const)arg;
-  if (p != NULL && p->tot_len > CANNELLONI_DATA_PACKET_BASE_SIZE) {
-    struct cannelloni_data_packet *data = (struct cannelloni_data_packet *)p->payload;
-    uint8_t error = 0;
-    /* Check for OP Code */
-    if (data->version != CANNELLONI_FRAME_VERSION) {
-      /* Received wrong version */
-      error = 1;
-    }
-    if (data->op_code != CNL_DATA) {
-      /* Received wrong OP code */
-      error = 1;
-    }
-    if (!error) {
-      uint16_t pos = CANNELLONI_DATA_PACKET_BASE_SIZE;
-      uint8_t *rawData = (uint8_t *)p->payload;
-      handle->udp_rx_count++;
-      uint16_t i = 0;
-      for (i = 0; i < ntohs(data->count); i++) {
-        if (pos + CANNELLONI_FRAME_BASE_SIZE > p->tot_len) {
-          /* Received incomplete packet */
-          error = 1;
-          break;
-        }
-        /* We got at least a complete canfd_frame header */
-        canid_t can_id = (rawData[pos] << 24) | (rawData[pos + 1] << 16) | (rawData[pos + 2] << 8) | (rawData[pos + 3]);
-        pos += sizeof(canid_t);
-
-        uint8_t len = rawData[pos++];
-        uint8_t dlc = len & ~CANFD_FRAME;
-
-        /* If this is a CAN FD frame, also retrieve the flags */
-        uint8_t flags = 0;
-        if (len & CANFD_FRAME) {
-          flags = rawData[pos++];
-        }
-        /* RTR Frames have no data section although they have a dlc */
-        if ((can_id & CAN_RTR_FLAG) == 0) {
-          /* Check again now that we know the dlc */
-          if (pos + dlc > p->tot_len) {
-            /* Received incomplete packet / can header corrupt! */
-            error = 1;
-            break;
-          }
-        }
-
-        struct canfd_frame *frame = queue_put(&handle->tx_queue);
-        if (!frame) {
-          /* Allocation error */
-          error = 1;
-          break;
-        }
-        frame->can_id = can_id;
-        frame->len = len;
-        frame->flags = flags;
-
-        /* RTR Frames have no data */
-        if ((can_id & CAN_RTR_FLAG) == 0) {
-          memcpy(frame->data, rawData + pos, dlc);
-          pos += dlc;
-        }
+  if (p != NULL) {
+    struct pbuf_cursor cursor;
+    struct cannelloni_data_packet data;
+    cursor_init(&cursor, p);
+    /* Check for version and OP Code */
+    if (cursor_read(&cursor, &data, sizeof(data)) && data.version == CANNELLONI_FRAME_VERSION) {
+      if (data.op_code == CNL_TIME_REQUEST) {
+        answer_time_request(handle, &cursor, port);
+      } else if (data.op_code == CNL_DATA) {
+        handle->udp_rx_count++;
+        decode_frames(handle, &cursor, ntohs(data.count));
       }
     }
   }
@@ -147,67 +305,349 @@ void handle_cannelloni_frame(void *arg, struct udp_pcb *pcb, struct pbuf *p, con
   }
 }
 
-bool transmit_udp_frame(cannelloni_handle_t *handle) {
-  struct canfd_frame *frame = queue_peek(&handle->rx_queue);
-  if (!frame) {
-    return false;
+static uint16_t put_u32(uint8_t *data, uint16_t pos, uint32_t value) {
+  data[pos + 0] = value >> 24 & 0x000000ff;
+  data[pos + 1] = value >> 16 & 0x000000ff;
+  data[pos + 2] = value >> 8 & 0x000000ff;
+  data[pos + 3] = value & 0x000000ff;
+  return pos + 4;
+}
+
+static uint16_t put_u64(uint8_t *data, uint16_t pos, uint64_t value) {
+  pos = put_u32(data, pos, value >> 32);
+  return put_u32(data, pos, value & 0xffffffff);
+}
+
+static uint64_t get_u64(const uint8_t *data) {
+  uint64_t value = 0;
+  for (uint8_t i = 0; i < 8; i++) {
+    value = value << 8 | data[i];
   }
+  return value;
+}
 
-  struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, 1200, PBUF_RAM);
-  if (!p) {
-    /* allocation error */
-    return false;
+/* Encodes the frame at pos and returns the position after it, timestamped frames start with their receive time */
+static uint16_t put_frame(uint8_t *data, uint16_t pos, const struct canfd_frame *frame, cnl_clock_fn clock) {
+  if (clock) {
+    pos = put_u32(data, pos, frame->timestamp);
   }
-  uint16_t pos = CANNELLONI_DATA_PACKET_BASE_SIZE;
-  uint8_t *data = (uint8_t *)p->payload;
-  uint16_t frameCount = 0;
+  pos = put_u32(data, pos, frame->can_id);
 
-  while (frame && pos + CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame) < p->tot_len) {
-    /* CAN frame fits in current UDP datagram, remove it from queue */
-    frame = queue_take(&handle->rx_queue);
+  data[pos++] = frame->len;
+  /* CAN FD frames carry their flags after the length */
+  if (frame->len & CANFD_FRAME) {
+    data[pos++] = frame->flags;
+  }
 
-    data[pos + 0] = frame->can_id >> 24 & 0x000000ff;
-    data[pos + 1] = frame->can_id >> 16 & 0x000000ff;
-    data[pos + 2] = frame->can_id >> 8 & 0x000000ff;
-    data[pos + 3] = frame->can_id & 0x000000ff;
-    pos += sizeof(canid_t);
+  memcpy(&data[pos], frame->data, canfd_len(frame));
+  return pos + canfd_len(frame);
+}
 
-    data[pos++] = frame->len;
+/* Allocates an empty datagram, leaving room in front for the headers of the transport */
+static struct pbuf *alloc_datagram(enum cnl_transport transport, pbuf_layer udp_layer) {
+  if (transport == CNL_TRANSPORT_UDP) {
+    return pbuf_alloc(udp_layer, 1200, PBUF_RAM);
+  }
 
-    memcpy(&data[pos], frame->data, canfd_len(frame));
-    pos += canfd_len(frame);
-    frameCount++;
+  struct pbuf *p = pbuf_alloc(PBUF_LINK, CNL_ETH_PORT_SIZE + 1200, PBUF_RAM);
+  if (p) {
+    pbuf_remove_header(p, CNL_ETH_PORT_SIZE);
+  }
+  return p;
+}
+
+/* Sends the datagram in an Ethernet frame to the MAC of the IPv6 group, the port in front tells the channel */
+static err_t send_eth(struct netif *netif, struct pbuf *p, const ip_addr_t *group, uint16_t port) {
+  const uint8_t *addr = (const uint8_t *)&ip_2_ip6(group)->addr[3];
+  struct eth_addr dst = {{0x33, 0x33, addr[0], addr[1], addr[2], addr[3]}};
 
-    /* peek at next CAN frame */
-    frame = queue_peek(&handle->rx_queue);
+  if (!netif) {
+    return ERR_IF;
   }
+  if (pbuf_add_header(p, CNL_ETH_PORT_SIZE)) {
+    return ERR_BUF;
+  }
+  uint8_t *data = (uint8_t *)p->payload;
+  data[0] = port >> 8;
+  data[1] = port & 0xff;
+  return ethernet_output(netif, p, (const struct eth_addr *)netif->hwaddr, &dst, CNL_ETHERTYPE);
+}
+
+/* False while backing off after a failed send */
+static bool retry_due(const struct cnl_retry *retry) {
+  return retry->failures == 0 || (int32_t)(sys_now() - retry->retry_at) >= 0;
+}
+
+/* Books the outcome of sending a datagram of count frames, true once they are done with:
+ * sent, or dropped after CNL_SEND_RETRIES failed attempts */
+static bool retry_commit(struct cnl_retry *retry, err_t err, uint16_t count) {
+  if (err == ERR_OK) {
+    retry->failures = 0;
+    return true;
+  }
+  if (retry->failures >= CNL_SEND_RETRIES) {
+    retry->failures = 0;
+    retry->dropped += count;
+    return true;
+  }
+  retry->retry_at = sys_now() + (1U << retry->failures);
+  retry->failures++;
+  return false;
+}
+
+/* Size of the datagram header, and of what every frame adds to its encoded size */
+static uint16_t header_size(cnl_clock_fn clock) {
+  return CANNELLONI_DATA_PACKET_BASE_SIZE + (clock ? CNL_TIMESTAMP_SIZE : 0);
+}
 
+static uint16_t frame_overhead(cnl_clock_fn clock) {
+  return clock ? CNL_TIMESTAMP_SIZE : 0;
+}
+
+static void put_header(struct pbuf *p, uint8_t op_code, uint8_t seq_no, uint16_t count, uint16_t len, cnl_clock_fn clock) {
   struct cannelloni_data_packet *dataPacket = (struct cannelloni_data_packet *)p->payload;
   dataPacket->version = CANNELLONI_FRAME_VERSION;
-  dataPacket->op_code = CNL_DATA;
-  dataPacket->seq_no = handle->sequence_number++;
-  dataPacket->count = htons(frameCount);
+  dataPacket->op_code = op_code;
+  dataPacket->seq_no = seq_no;
+  dataPacket->count = htons(count);
+
+  /* Taken last, so the frames' ages cover as much of their wait as possible */
+  if (clock) {
+    dataPacket->op_code |= CNL_OP_TIMESTAMPS;
+    put_u32((uint8_t *)p->payload, CANNELLONI_DATA_PACKET_BASE_SIZE, clock());
+  }
+
+  p->tot_len = len;
+  p->len = len;
+}
+
+void init_cnl_clock(cnl_clock_t *const clock) {
+  clock->local_last = clock->Init.local_fn();
+  clock->local_wraps = 0;
+  clock->local_ref = 0;
+  clock->master_ref = 0;
+  clock->drift_ppb = 0;
+  clock->drift_local_ref = 0;
+  clock->drift_master_ref = 0;
+  clock->best_round_trip = UINT32_MAX;
+  clock->synced = false;
+}
+
+uint64_t cnl_clock_local(cnl_clock_t *const clock) {
+  SYS_ARCH_DECL_PROTECT(lev);
+  SYS_ARCH_PROTECT(lev);
+  uint32_t now = clock->Init.local_fn();
+  if (now < clock->local_last) {
+    clock->local_wraps++;
+  }
+  clock->local_last = now;
+  uint64_t local = (uint64_t)clock->local_wraps << 32 | now;
+  SYS_ARCH_UNPROTECT(lev);
+  return local;
+}
+
+/* Callers hold the protection */
+static int64_t clock_master(const cnl_clock_t *clock, uint64_t local) {
+  int64_t elapsed = (int64_t)(local - clock->local_ref);
+  return clock->master_ref + elapsed * 1000 + elapsed * clock->drift_ppb / 1000000;
+}
+
+int64_t cnl_clock_master(cnl_clock_t *const clock, uint64_t local) {
+  SYS_ARCH_DECL_PROTECT(lev);
+  SYS_ARCH_PROTECT(lev);
+  int64_t master = clock_master(clock, local);
+  SYS_ARCH_UNPROTECT(lev);
+  return master;
+}
+
+/* Steers the clock towards the bridge's reading master ns at local µs, taken over round_trip ns */
+static void clock_sample(cnl_clock_t *clock, uint64_t local, int64_t master, int64_t round_trip) {
+  SYS_ARCH_DECL_PROTECT(lev);
+  SYS_ARCH_PROTECT(lev);
+
+  /* Queueing rarely delays both ways alike, so only near the fastest exchanges count, and the
+   * fastest is slowly forgotten in case the path got longer */
+  if (round_trip < 0 || (uint64_t)round_trip > 2 * clock->best_round_trip) {
+    clock->best_round_trip += clock->best_round_trip / 8;
+    SYS_ARCH_UNPROTECT(lev);
+    return;
+  }
+  if ((uint64_t)round_trip < clock->best_round_trip) {
+    clock->best_round_trip = round_trip;
+  }
+
+  int64_t predicted = clock_master(clock, local);
+  int64_t error = master - predicted;
+  if (!clock->synced || error > CNL_CLOCK_STEP_NS || error < -CNL_CLOCK_STEP_NS) {
+    clock->master_ref = master;
+    clock->synced = true;
+    clock->drift_local_ref = local;
+    clock->drift_master_ref = master;
+  } else {
+    /* Half of the phase, one asymmetric exchange must not jerk the clock */
+    clock->master_ref = predicted + error / 2;
+
+    /* Against the clock as the last frequency correction left it, the error is what the drift
+     * added since; a sixteenth of that rate goes into the frequency */
+    int64_t interval = (int64_t)(local - clock->drift_local_ref);
+    if (interval >= CNL_CLOCK_MIN_INTERVAL_US) {
+      int64_t expected = clock->drift_master_ref + interval * 1000 + interval * clock->drift_ppb / 1000000;
+      int64_t drift = clock->drift_ppb + (master - expected) * 1000000 / interval / 16;
+      if (drift > CNL_CLOCK_MAX_DRIFT_PPB) {
+        drift = CNL_CLOCK_MAX_DRIFT_PPB;
+      } else if (drift < -CNL_CLOCK_MAX_DRIFT_PPB) {
+        drift = -CNL_CLOCK_MAX_DRIFT_PPB;
+      }
+      clock->drift_ppb = drift;
+      clock->drift_local_ref = local;
+      clock->drift_master_ref = clock->master_ref;
+    }
+  }
+  clock->local_ref = local;
+  SYS_ARCH_UNPROTECT(lev);
+}
+
+/* Answers with t2 and t3 from our clock, and samples the exchange the request completes:
+ * the bridge got our last reply at last_t4, less the time we took to answer it was travel */
+static void answer_time_request(cannelloni_handle_t *handle, struct pbuf_cursor *cursor, uint16_t port) {
+  cnl_clock_t *clock = handle->Init.clock;
+  uint8_t times[CNL_TIME_REQUEST_SIZE - CANNELLONI_DATA_PACKET_BASE_SIZE];
+  if (!clock || !cursor_read(cursor, times, sizeof(times))) {
+    return;
+  }
+  uint64_t l2 = cnl_clock_local(clock);
+
+  uint64_t t1 = get_u64(times);
+  uint64_t last_t1 = get_u64(times + 8);
+  uint64_t last_t4 = get_u64(times + 16);
+  if (last_t1 && last_t1 == handle->time_exchange.t1) {
+    int64_t answer = (int64_t)(handle->time_exchange.l3 - handle->time_exchange.l2) * 1000;
+    int64_t round_trip = (int64_t)(last_t4 - last_t1) - answer;
+    clock_sample(clock, handle->time_exchange.l2, (int64_t)last_t1 + round_trip / 2, round_trip);
+  }
+
+  struct pbuf *reply = alloc_datagram(handle->Init.transport, PBUF_TRANSPORT);
+  if (!reply) {
+    /* allocation error */
+    return;
+  }
+  uint8_t *data = (uint8_t *)reply->payload;
+  put_u64(data, CANNELLONI_DATA_PACKET_BASE_SIZE, t1);
+  put_u64(data, CANNELLONI_DATA_PACKET_BASE_SIZE + 8, cnl_clock_master(clock, l2));
+  data[CANNELLONI_DATA_PACKET_BASE_SIZE + 24] = clock->synced;
+  put_header(reply, CNL_TIME_REPLY, 0, 0, CNL_TIME_REPLY_SIZE, NULL);
+
+  /* Taken last, so the bridge's round trip leaves out as much of the answer as possible */
+  uint64_t l3 = cnl_clock_local(clock);
+  put_u64(data, CANNELLONI_DATA_PACKET_BASE_SIZE + 16, cnl_clock_master(clock, l3));
+
+  /* To the group, the bridge listens there on the port it asked from */
+  if (handle->Init.transport == CNL_TRANSPORT_ETH) {
+    send_eth(handle->Init.netif, reply, &(handle->Init.addr), handle->Init.port);
+  } else {
+    udp_sendto(handle->udp_pcb, reply, &(handle->Init.addr), port);
+  }
+  pbuf_free(reply);
+
+  handle->time_exchange.t1 = t1;
+  handle->time_exchange.l2 = l2;
+  handle->time_exchange.l3 = l3;
+}
+
+bool transmit_udp_frame(cannelloni_handle_t *handle) {
+  frames_queue_t *q = &handle->rx_queue;
+  uint32_t queued = queue_acquire(q, UINT32_MAX);
+  if (!queued) {
+    return false;
+  }
 
-  p->tot_len = pos;
-  p->len = pos;
+  /* Sending in place moves the payload behind the headers, a datagram for several
+   * destinations gets a separate header pbuf for each instead */
+  uint8_t destinations = handle->Init.destination_count;
+  struct pbuf *p = alloc_datagram(handle->Init.transport, destinations > 1 ? PBUF_RAW : PBUF_TRANSPORT);
+  if (!p) {
+    /* allocation error */
+    return false;
+  }
+  cnl_clock_fn clock = handle->Init.clock_fn;
+  uint16_t pos = header_size(clock);
+  uint8_t *data = (uint8_t *)p->payload;
+  uint16_t frameCount = 0;
 
-  udp_sendto(handle->udp_pcb, p, &(handle->Init.addr), handle->Init.remote_port);
+  while (frameCount < queued) {
+    struct canfd_frame *frame = queue_slot(q, q->head + frameCount);
+    if (pos + frame_overhead(clock) + canfd_frame_size(frame) >= p->tot_len) {
+      break;
+    }
+    /* CAN frame fits in current UDP datagram, it leaves the queue once sent */
+    pos = put_frame(data, pos, frame, clock);
+    frameCount++;
+  }
+
+  put_header(p, CNL_DATA, handle->sequence_number, frameCount, pos, clock);
+
+  err_t err = ERR_OK;
+  if (handle->Init.transport == CNL_TRANSPORT_ETH) {
+    err = send_eth(handle->Init.netif, p, &(handle->Init.addr), handle->Init.port);
+  } else if (destinations == 0) {
+    err = udp_sendto(handle->udp_pcb, p, &(handle->Init.addr), handle->Init.remote_port);
+  } else {
+    /* Sent once any destination took it, a retry would repeat it to the others */
+    err = ERR_RTE;
+    for (uint8_t i = 0; i < destinations; i++) {
+      if (udp_sendto(handle->udp_pcb, p, &(handle->Init.destinations[i].addr), handle->Init.destinations[i].port) == ERR_OK) {
+        err = ERR_OK;
+      }
+    }
+  }
   pbuf_free(p);
 
+  if (!retry_commit(&handle->retry, err, frameCount)) {
+    return false;
+  }
+  handle->sequence_number++;
+  queue_release(q, frameCount);
+  if (frameCount == queued) {
+    handle->express_pending = false;
+  }
+
   /* return TRUE if queue contains more CAN frames */
-  return frame != NULL;
+  return frameCount < queued;
 }
 
 void transmit_can_frames(cannelloni_handle_t *const handle) {
   if (!handle->Init.can_tx_fn)
     return;
-  struct canfd_frame *frame = queue_peek(&handle->tx_queue);
-  while (frame && handle->Init.can_tx_fn(handle, frame)) {
-    /* drop CAN frame as it was processed by CAN driver */
-    queue_take(&handle->tx_queue);
+  frames_queue_t *q = &handle->tx_queue;
+  /* Express frames are handed to the controller from the network interrupt as well, both go through
+   * the controller's IF2 registers, which the main loop's receives on IF1 don't touch */
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  uint32_t queued = queue_acquire(q, UINT32_MAX);
+  while (queued) {
+    /* The network interrupt may overwrite the oldest frame while it is copied */
+    uint32_t index = q->head;
+    struct canfd_frame frame = *queue_slot(q, index);
+    if (!queue_intact(q, index)) {
+      queued = queue_acquire(q, UINT32_MAX);
+      continue;
+    }
 
-    /* peek at next CAN frame */
-    frame = queue_peek(&handle->tx_queue);
+    /* Past their deadline frames only delay the ones behind them */
+    if (handle->Init.tx_max_age_ms && sys_now() - frame.timestamp > handle->Init.tx_max_age_ms) {
+      handle->tx_expired++;
+    } else {
+      SYS_ARCH_PROTECT(lev);
+      bool sent = handle->Init.can_tx_fn(handle, &frame);
+      SYS_ARCH_UNPROTECT(lev);
+      if (!sent) {
+        break;
+      }
+    }
+
+    /* drop CAN frame as it was processed by CAN driver */
+    queue_release(q, 1);
+    queued--;
   }
 }
 
@@ -218,17 +658,161 @@ void receive_can_frames(cannelloni_handle_t *handle) {
   handle->Init.can_rx_fn(handle);
 }
 
+/* Whether enough frames are queued, or the oldest waited long enough, for a datagram */
+static bool batch_ready(cannelloni_handle_t *handle) {
+  size_t queued = queue_size(&handle->rx_queue);
+  if (queued == 0) {
+    return false;
+  }
+  if (queued >= handle->Init.batch_frames || handle->express_pending) {
+    return true;
+  }
+  return sys_now() - handle->batch_start >= handle->Init.batch_timeout_ms;
+}
+
 void run_cannelloni(cannelloni_handle_t *const handle) {
   transmit_can_frames(handle);
+  uint32_t first = handle->rx_queue.tail;
   receive_can_frames(handle);
-  while (transmit_udp_frame(handle))
+  mark_express(handle, first);
+  while (!handle->muxed && retry_due(&handle->retry) && batch_ready(handle) && transmit_udp_frame(handle))
+    ;
+}
+
+/* Fills one datagram from the channels in order, returns TRUE if frames are left */
+static bool transmit_mux_frame(cannelloni_mux_t *mux) {
+  struct pbuf *p = alloc_datagram(mux->Init.transport, PBUF_TRANSPORT);
+  if (!p) {
+    /* allocation error */
+    return false;
+  }
+  cnl_clock_fn clock = mux->Init.clock_fn;
+  uint16_t pos = header_size(clock);
+  uint8_t *data = (uint8_t *)p->payload;
+  uint16_t frameCount = 0;
+  /* Frames encoded per channel, they leave the queues once sent */
+  uint32_t taken[CNL_MUX_MAX_CHANNELS] = {0};
+  bool full = false;
+
+  for (uint8_t channel = 0; channel < mux->Init.channel_count && !full; channel++) {
+    frames_queue_t *queue = &mux->Init.channels[channel]->rx_queue;
+    uint32_t queued = queue_acquire(queue, UINT32_MAX);
+    while (taken[channel] < queued) {
+      struct canfd_frame *frame = queue_slot(queue, queue->head + taken[channel]);
+      if (pos + 1 + frame_overhead(clock) + canfd_frame_size(frame) >= p->tot_len) {
+        full = true;
+        break;
+      }
+      data[pos++] = channel;
+      pos = put_frame(data, pos, frame, clock);
+      frameCount++;
+      taken[channel]++;
+    }
+  }
+
+  err_t err = ERR_OK;
+  if (frameCount) {
+    put_header(p, CNL_MUX_DATA, mux->sequence_number, frameCount, pos, clock);
+    if (mux->Init.transport == CNL_TRANSPORT_ETH) {
+      err = send_eth(mux->Init.netif, p, &(mux->Init.addr), mux->Init.port);
+    } else {
+      err = udp_sendto(mux->udp_pcb, p, &(mux->Init.addr), mux->Init.port);
+    }
+  }
+  pbuf_free(p);
+
+  if (!frameCount || !retry_commit(&mux->retry, err, frameCount)) {
+    return false;
+  }
+  mux->sequence_number++;
+  for (uint8_t channel = 0; channel < mux->Init.channel_count; channel++) {
+    cannelloni_handle_t *handle = mux->Init.channels[channel];
+    /* Given up on, the channels count their share as if they had sent it themselves */
+    if (err != ERR_OK) {
+      handle->retry.dropped += taken[channel];
+    }
+    queue_release(&handle->rx_queue, taken[channel]);
+    if (!queue_size(&handle->rx_queue)) {
+      handle->express_pending = false;
+    }
+  }
+  return full;
+}
+
+void init_cannelloni_mux(cannelloni_mux_t *const mux) {
+  mux->sequence_number = 0;
+  memset(&mux->retry, 0, sizeof(mux->retry));
+  for (uint8_t channel = 0; channel < mux->Init.channel_count; channel++) {
+    mux->Init.channels[channel]->muxed = true;
+  }
+
+  if (mux->Init.transport == CNL_TRANSPORT_ETH) {
+    return;
+  }
+  mux->udp_pcb = udp_new();
+  if (mux->udp_pcb == NULL) {
+    return;
+  }
+  udp_bind(mux->udp_pcb, IP_ADDR_ANY, mux->Init.port);
+}
+
+void run_cannelloni_mux(cannelloni_mux_t *const mux) {
+  bool ready = false;
+  for (uint8_t channel = 0; channel < mux->Init.channel_count; channel++) {
+    ready |= batch_ready(mux->Init.channels[channel]);
+  }
+  while (ready && retry_due(&mux->retry) && transmit_mux_frame(mux))
     ;
 }
 
+err_t cannelloni_eth_input(struct pbuf *p, struct netif *netif) {
+  struct eth_hdr *eth = (struct eth_hdr *)p->payload;
+  if (eth->type != PP_HTONS(CNL_ETHERTYPE)) {
+    return ERR_VAL;
+  }
+
+  uint8_t port[CNL_ETH_PORT_SIZE];
+  if (pbuf_remove_header(p, SIZEOF_ETH_HDR) || pbuf_copy_partial(p, port, sizeof(port), 0) != sizeof(port)) {
+    pbuf_free(p);
+    return ERR_OK;
+  }
+  pbuf_remove_header(p, CNL_ETH_PORT_SIZE);
+
+  for (uint8_t i = 0; i < eth_channel_count; i++) {
+    cannelloni_handle_t *handle = eth_channels[i];
+    if (handle->Init.netif == netif && handle->Init.port == (port[0] << 8 | port[1])) {
+      /* Frees the pbuf */
+      handle_cannelloni_frame(handle, NULL, p, NULL, 0);
+      return ERR_OK;
+    }
+  }
+  pbuf_free(p);
+  return ERR_OK;
+}
+
 struct canfd_frame *get_can_rx_frame(cannelloni_handle_t *const handle) {
-  return queue_put(&handle->rx_queue);
+  frames_queue_t *q = &handle->rx_queue;
+  if (queue_size(q) == 0) {
+    handle->batch_start = sys_now();
+  }
+  if (!queue_reserve(q, 1, handle->Init.queue_policy == CNL_DROP_OLDEST)) {
+    return NULL;
+  }
+  return queue_slot(q, q->tail);
+}
+
+void commit_can_rx_frame(cannelloni_handle_t *const handle) {
+  queue_commit(&handle->rx_queue, 1);
 }
 
 uint8_t canfd_len(const struct canfd_frame *f) {
   return f->len & ~(CANFD_FRAME);
 }
+
+uint8_t canfd_frame_size(const struct canfd_frame *f) {
+  uint8_t size = CANNELLONI_FRAME_BASE_SIZE + canfd_len(f);
+  if (f->len & CANFD_FRAME) {
+    size++;
+  }
+  return size;
+}
@@ -25,6 +25,7 @@
 #include "stdbool.h"
 #include "ip_addr.h"
 #include "pbuf.h"
+#include "netif.h"
 
 /* Base size of a canfd_frame (canid + dlc) */
 #define CANNELLONI_FRAME_BASE_SIZE 5
@@ -36,7 +37,37 @@
 
 enum op_codes { CNL_DATA,
                 CNL_ACK,
-                CNL_NACK };
+                CNL_NACK,
+                /* Frames of several channels, each prefixed with its channel index */
+                CNL_MUX_DATA,
+                /* Two-way time transfer, the bridge asks and the gateway answers with its clock */
+                CNL_TIME_REQUEST,
+                CNL_TIME_REPLY };
+
+/* Set in the op code of datagrams whose header is followed by their send time and
+ * whose frames start with their receive time, big endian microseconds of the gateway's clock */
+#define CNL_OP_TIMESTAMPS 0x40
+#define CNL_TIMESTAMP_SIZE 4
+
+/* Header, then big endian ns of the bridge: t1 of this request and t1 and t4 of the previous exchange */
+#define CNL_TIME_REQUEST_SIZE (CANNELLONI_DATA_PACKET_BASE_SIZE + 3 * 8)
+/* Header, then t1 echoed, t2 and t3 from the gateway's synchronised clock and whether it is synchronised */
+#define CNL_TIME_REPLY_SIZE (CANNELLONI_DATA_PACKET_BASE_SIZE + 3 * 8 + 1)
+
+/* Errors beyond this step the clock instead of slewing it */
+#ifndef CNL_CLOCK_STEP_NS
+#define CNL_CLOCK_STEP_NS 1000000
+#endif
+
+/* Bound of the frequency correction, crystals are well within it */
+#ifndef CNL_CLOCK_MAX_DRIFT_PPB
+#define CNL_CLOCK_MAX_DRIFT_PPB 500000
+#endif
+
+/* Frequency corrections are at least this far apart, shorter spans are too short to tell the drift */
+#ifndef CNL_CLOCK_MIN_INTERVAL_US
+#define CNL_CLOCK_MIN_INTERVAL_US 500000
+#endif
 
 struct __attribute__((__packed__)) cannelloni_data_packet {
   /* Version */
@@ -65,36 +96,149 @@ typedef uint32_t canid_t;
 #define CNL_CANFD_MAX_DLEN 8
 #endif
 
+/* EtherType of datagrams sent straight over Ethernet, IEEE 802 local experimental */
+#define CNL_ETHERTYPE 0x88B5
+/* Raw Ethernet datagrams start with the big endian port of their channel */
+#define CNL_ETH_PORT_SIZE 2
+
+/* Number of channels receiving datagrams over raw Ethernet */
+#ifndef CNL_ETH_MAX_CHANNELS
+#define CNL_ETH_MAX_CHANNELS 4
+#endif
+
+/* Number of channels sharing multiplexed datagrams */
+#ifndef CNL_MUX_MAX_CHANNELS
+#define CNL_MUX_MAX_CHANNELS 4
+#endif
+
+/* Number of destinations a channel can send to at once */
+#ifndef CNL_MAX_DESTINATIONS
+#define CNL_MAX_DESTINATIONS 4
+#endif
+
+/* Number of ID matches marking a channel's express frames */
+#ifndef CNL_EXPRESS_MAX
+#define CNL_EXPRESS_MAX 8
+#endif
+
+/* Failed sends of a datagram before its frames are dropped, retried after 1, 2, 4... ms */
+#ifndef CNL_SEND_RETRIES
+#define CNL_SEND_RETRIES 5
+#endif
+
 struct canfd_frame {
-  canid_t can_id; /* 32 bit CAN_ID + EFF/RTR/ERR flags */
-  uint8_t len;    /* frame payload length in byte */
-  uint8_t flags;  /* additional flags for CAN FD */
+  canid_t can_id;     /* 32 bit CAN_ID + EFF/RTR/ERR flags */
+  uint8_t len;        /* frame payload length in byte */
+  uint8_t flags;      /* additional flags for CAN FD */
+  uint32_t timestamp; /* received: time from the handle's clock_fn, to send: sys_now() when queued */
   uint8_t data[CNL_CANFD_MAX_DLEN] __attribute__((aligned(8)));
 };
 
+/* Ring of a power of two frames with free-running indices. Only the consumer moves head and only
+ * the producer tail, so either may run in an interrupt without locking. */
 typedef struct {
-  size_t head;
-  size_t tail;
-  size_t count;
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  uint32_t mask;
   struct canfd_frame *frames;
 } frames_queue_t;
 
+/* What to give up when a frame queue is full, the oldest frames are overwritten in place */
+enum cnl_queue_policy { CNL_DROP_NEWEST,
+                        CNL_DROP_OLDEST };
+
+/* How datagrams travel between gateway and bridge */
+enum cnl_transport { CNL_TRANSPORT_UDP,
+                     /* Ethernet frames of type CNL_ETHERTYPE to the group's MAC, no IP/UDP headers */
+                     CNL_TRANSPORT_ETH };
+
+struct cnl_destination {
+  ip_addr_t addr;
+  uint16_t port;
+};
+
+/* Matches frames whose ID equals id in all bits set in mask, extended IDs only match entries with CAN_EFF_FLAG */
+struct cnl_id_match {
+  canid_t id;
+  canid_t mask;
+};
+
+/* Frames stay queued until their datagram was sent, failed sends back off and are retried */
+struct cnl_retry {
+  uint8_t failures;
+  /* sys_now() from which the next attempt may go out */
+  uint32_t retry_at;
+  /* Frames given up on after CNL_SEND_RETRIES */
+  uint32_t dropped;
+};
+
 typedef struct cannelloni_handle cannelloni_handle_t;
 
 typedef bool (*cnl_can_tx_fn)(cannelloni_handle_t *const, struct canfd_frame *const);
 typedef void (*cnl_can_rx_fn)(cannelloni_handle_t *const);
+/* Free-running microseconds, wrapping at 2^32 */
+typedef uint32_t (*cnl_clock_fn)(void);
+
+/* The bridge's clock, followed with a local microsecond counter corrected for offset and drift.
+ * Shared by all channels of a gateway, exchanges may update it from interrupt context. */
+typedef struct {
+  struct {
+    /* Exchanges read it every second, a wrap missed while no bridge asks makes the next one step the clock */
+    cnl_clock_fn local_fn;
+  } Init;
+
+  /* local_fn extended to 64 bit */
+  uint32_t local_last;
+  uint32_t local_wraps;
+  /* At local_ref µs the bridge's clock read master_ref ns, it runs drift_ppb fast against ours since */
+  uint64_t local_ref;
+  int64_t master_ref;
+  int32_t drift_ppb;
+  /* Where the last frequency correction left the clock, exchanges of all channels move local_ref
+   * in between, the drift is only told over CNL_CLOCK_MIN_INTERVAL_US from here */
+  uint64_t drift_local_ref;
+  int64_t drift_master_ref;
+  /* Shortest round trip in ns seen recently, longer ones are mostly queueing */
+  uint64_t best_round_trip;
+  bool synced;
+} cnl_clock_t;
 
 typedef struct cannelloni_handle {
   struct {
     uint16_t port;
     ip_addr_t addr;
     uint16_t remote_port;
+    /* Frames in each of can_tx_buf and can_rx_buf, a power of two */
     uint8_t can_buf_size;
     struct canfd_frame *can_tx_buf;
     struct canfd_frame *can_rx_buf;
     cnl_can_tx_fn can_tx_fn;
     cnl_can_rx_fn can_rx_fn;
+    /* The controller sends CAN FD frames, FD frames for the bus are dropped otherwise */
+    bool can_fd;
     void *user_data;
+    /* Datagrams go to these instead of addr/remote_port when set */
+    struct cnl_destination destinations[CNL_MAX_DESTINATIONS];
+    uint8_t destination_count;
+    /* A datagram is sent once batch_frames are queued or the first waited batch_timeout_ms */
+    uint16_t batch_frames;
+    uint16_t batch_timeout_ms;
+    enum cnl_queue_policy queue_policy;
+    /* Frames for the bus are dropped once queued longer than this, 0 keeps them */
+    uint16_t tx_max_age_ms;
+    /* A frame for the bus replaces the payload of a queued one with the same ID, latest value wins */
+    bool tx_coalesce;
+    /* With CNL_TRANSPORT_ETH datagrams skip the UDP pcb and destinations and go out on netif */
+    enum cnl_transport transport;
+    struct netif *netif;
+    /* When set, datagrams carry the receive time the can_rx_fn put into each frame */
+    cnl_clock_fn clock_fn;
+    /* When set, the channel answers the bridge's time requests and steers this clock */
+    cnl_clock_t *clock;
+    /* Frames matching any of these skip batching: received ones send the queue right away,
+     * ones for the bus go straight to the controller when nothing is queued ahead of them */
+    struct cnl_id_match express[CNL_EXPRESS_MAX];
+    uint8_t express_count;
   } Init;
 
   frames_queue_t tx_queue;
@@ -103,17 +247,72 @@ typedef struct cannelloni_handle {
   uint32_t sequence_number;
   struct udp_pcb *udp_pcb;
   uint32_t udp_rx_count;
+  /* sys_now() when the oldest frame waiting for a datagram was queued */
+  uint32_t batch_start;
+  struct cnl_retry retry;
+  /* Frames for the bus dropped past tx_max_age_ms, and queued payloads replaced by coalescing */
+  uint32_t tx_expired;
+  uint32_t tx_coalesced;
+  /* Received CAN frames leave through the mux instead of the channel's own datagrams */
+  bool muxed;
+  /* An express frame waits in rx_queue, the queue is sent without waiting for the batch */
+  bool express_pending;
+  /* Bridge's t1 of the last exchange answered, and the local µs it was received and answered at */
+  struct {
+    uint64_t t1;
+    uint64_t l2;
+    uint64_t l3;
+  } time_exchange;
 } cannelloni_handle_t;
 
+/* Sends the CAN frames of several channels in shared datagrams to addr and port,
+ * a datagram goes out once any of the channels would send one on its own */
+typedef struct {
+  struct {
+    uint16_t port;
+    ip_addr_t addr;
+    cannelloni_handle_t *channels[CNL_MUX_MAX_CHANNELS];
+    uint8_t channel_count;
+    enum cnl_transport transport;
+    struct netif *netif;
+    cnl_clock_fn clock_fn;
+  } Init;
+
+  uint32_t sequence_number;
+  struct udp_pcb *udp_pcb;
+  struct cnl_retry retry;
+} cannelloni_mux_t;
+
 /* Helper function to get the real length of a frame */
 uint8_t canfd_len(const struct canfd_frame *f);
 
+/* Helper function to get the encoded size of a frame including the FD flags */
+uint8_t canfd_frame_size(const struct canfd_frame *f);
+
 void init_cannelloni(cannelloni_handle_t *const handle);
 
 void run_cannelloni(cannelloni_handle_t *const handle);
 
 void handle_cannelloni_frame(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, uint16_t port);
 
+/* lwIP hook for frames of unknown EtherType, consumes and returns ERR_OK for CNL_ETHERTYPE */
+err_t cannelloni_eth_input(struct pbuf *p, struct netif *netif);
+
+/* Reserves the slot for the next received frame, it is queued by commit_can_rx_frame once filled */
 struct canfd_frame *get_can_rx_frame(cannelloni_handle_t *const handle);
 
+void commit_can_rx_frame(cannelloni_handle_t *const handle);
+
+void init_cnl_clock(cnl_clock_t *const clock);
+
+/* Local time in µs, extended from clock->Init.local_fn */
+uint64_t cnl_clock_local(cnl_clock_t *const clock);
+
+/* The bridge's time in ns at the local µs, only meaningful once clock->synced */
+int64_t cnl_clock_master(cnl_clock_t *const clock, uint64_t local);
+
+void init_cannelloni_mux(cannelloni_mux_t *const mux);
+
+void run_cannelloni_mux(cannelloni_mux_t *const mux);
+
 #endif
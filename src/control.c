@@ -0,0 +1,283 @@
+#include <string.h>
+#include "udp.h"
+#include "netif.h"
+#include "sys.h"
+#include "control.h"
+#include "gateway.h"
+
+#define CTL_REPLY_SIZE 320
+#define CTL_DESTINATION_SIZE 18
+
+extern struct netif netif;
+
+static struct udp_pcb *control_pcb;
+
+/* Requests arrive in the network interrupt and are applied and answered by run_control in the main
+ * loop, which reads the settings meanwhile; one at a time, later ones are dropped until it is done */
+static struct {
+  volatile bool pending;
+  uint8_t data[CTL_HEADER_SIZE + 255];
+  uint16_t len;
+  ip_addr_t addr;
+  uint16_t port;
+} control_request;
+
+static uint16_t get_u16(const uint8_t *p) {
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t value) {
+  *p++ = value >> 8;
+  *p++ = value;
+  return p;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t value) {
+  p = put_u16(p, value >> 16);
+  return put_u16(p, value);
+}
+
+static uint8_t *put_param(uint8_t *p, uint8_t type, uint8_t len) {
+  *p++ = type;
+  *p++ = len;
+  return p;
+}
+
+/* Checks every parameter of a set request before anything is applied */
+static bool control_validate(const uint8_t *params, uint16_t len) {
+  uint16_t pos = 0;
+  while (pos < len) {
+    if (pos + 2 > len || pos + 2 + params[pos + 1] > len) {
+      return false;
+    }
+    uint8_t plen = params[pos + 1];
+    const uint8_t *value = &params[pos + 2];
+    switch (params[pos]) {
+      case CTL_BATCH_FRAMES:
+      case CTL_BATCH_TIMEOUT:
+      case CTL_TX_MAX_AGE:
+        if (plen != 2) {
+          return false;
+        }
+        break;
+      case CTL_BITRATE:
+        if (plen != 4 && plen != 6) {
+          return false;
+        }
+        break;
+      case CTL_FILTERS:
+        if (plen % 8 || plen / 8 > CAN_FILTERS_MAX) {
+          return false;
+        }
+        break;
+      case CTL_EXPRESS:
+        if (plen % 8 || plen / 8 > CNL_EXPRESS_MAX) {
+          return false;
+        }
+        break;
+      case CTL_DESTINATIONS:
+        if (plen % CTL_DESTINATION_SIZE || plen / CTL_DESTINATION_SIZE > CNL_MAX_DESTINATIONS) {
+          return false;
+        }
+        break;
+      case CTL_QUEUE_POLICY:
+        if (plen != 1 || value[0] > CNL_DROP_OLDEST) {
+          return false;
+        }
+        break;
+      case CTL_TX_COALESCE:
+        if (plen != 1 || value[0] > 1) {
+          return false;
+        }
+        break;
+      default:
+        return false;
+    }
+    pos += 2 + plen;
+  }
+  return true;
+}
+
+static uint8_t control_set(struct CANInterface *iface, const uint8_t *params, uint16_t len) {
+  if (!control_validate(params, len)) {
+    return CTL_BAD_REQUEST;
+  }
+
+  // the bitrate is the only parameter the hardware may refuse, nothing else changes then
+  for (uint16_t pos = 0; pos < len; pos += 2 + params[pos + 1]) {
+    const uint8_t *value = &params[pos + 2];
+    if (params[pos] == CTL_BITRATE) {
+      uint16_t sample_point = params[pos + 1] == 6 ? get_u16(value + 4) : 0;
+      if (!set_can_bitrate(iface, get_u32(value), sample_point)) {
+        return CTL_REJECTED;
+      }
+    }
+  }
+
+  cannelloni_handle_t *cannelloni = &iface->cannelloni;
+  for (uint16_t pos = 0; pos < len; pos += 2 + params[pos + 1]) {
+    uint8_t plen = params[pos + 1];
+    const uint8_t *value = &params[pos + 2];
+    switch (params[pos]) {
+      case CTL_BATCH_FRAMES:
+        cannelloni->Init.batch_frames = get_u16(value);
+        break;
+      case CTL_BATCH_TIMEOUT:
+        cannelloni->Init.batch_timeout_ms = get_u16(value);
+        break;
+      case CTL_FILTERS: {
+        struct can_filter filters[CAN_FILTERS_MAX];
+        for (uint8_t i = 0; i < plen / 8; i++) {
+          filters[i].id = get_u32(value + i * 8);
+          filters[i].mask = get_u32(value + i * 8 + 4);
+        }
+        set_can_filters(iface, filters, plen / 8);
+        break;
+      }
+      case CTL_DESTINATIONS:
+        for (uint8_t i = 0; i < plen / CTL_DESTINATION_SIZE; i++) {
+          struct cnl_destination *dst = &cannelloni->Init.destinations[i];
+          const uint8_t *entry = value + i * CTL_DESTINATION_SIZE;
+          ip_addr_set_zero_ip6(&dst->addr);
+          memcpy(ip_2_ip6(&dst->addr)->addr, entry, 16);
+          ip6_addr_assign_zone(ip_2_ip6(&dst->addr), IP6_UNKNOWN, &netif);
+          dst->port = get_u16(entry + 16);
+        }
+        cannelloni->Init.destination_count = plen / CTL_DESTINATION_SIZE;
+        break;
+      case CTL_QUEUE_POLICY:
+        cannelloni->Init.queue_policy = (enum cnl_queue_policy)value[0];
+        break;
+      case CTL_EXPRESS: {
+        /* Frames from the network are matched against them in the interrupt */
+        SYS_ARCH_DECL_PROTECT(lev);
+        SYS_ARCH_PROTECT(lev);
+        for (uint8_t i = 0; i < plen / 8; i++) {
+          cannelloni->Init.express[i].id = get_u32(value + i * 8);
+          cannelloni->Init.express[i].mask = get_u32(value + i * 8 + 4);
+        }
+        cannelloni->Init.express_count = plen / 8;
+        SYS_ARCH_UNPROTECT(lev);
+        break;
+      }
+      case CTL_TX_MAX_AGE:
+        cannelloni->Init.tx_max_age_ms = get_u16(value);
+        break;
+      case CTL_TX_COALESCE:
+        cannelloni->Init.tx_coalesce = value[0];
+        break;
+    }
+  }
+  return CTL_OK;
+}
+
+/* Appends every parameter of the channel */
+static uint8_t *control_report(struct CANInterface *iface, uint8_t *p) {
+  cannelloni_handle_t *cannelloni = &iface->cannelloni;
+
+  p = put_u16(put_param(p, CTL_BATCH_FRAMES, 2), cannelloni->Init.batch_frames);
+  p = put_u16(put_param(p, CTL_BATCH_TIMEOUT, 2), cannelloni->Init.batch_timeout_ms);
+  p = put_u16(put_u32(put_param(p, CTL_BITRATE, 6), iface->bitrate), iface->sample_point);
+
+  p = put_param(p, CTL_FILTERS, iface->filters.count * 8);
+  for (uint8_t i = 0; i < iface->filters.count; i++) {
+    p = put_u32(p, iface->filters.filters[i].id);
+    p = put_u32(p, iface->filters.filters[i].mask);
+  }
+
+  p = put_param(p, CTL_DESTINATIONS, cannelloni->Init.destination_count * CTL_DESTINATION_SIZE);
+  for (uint8_t i = 0; i < cannelloni->Init.destination_count; i++) {
+    memcpy(p, ip_2_ip6(&cannelloni->Init.destinations[i].addr)->addr, 16);
+    p = put_u16(p + 16, cannelloni->Init.destinations[i].port);
+  }
+
+  p = put_param(p, CTL_QUEUE_POLICY, 1);
+  *p++ = cannelloni->Init.queue_policy;
+
+  p = put_param(p, CTL_EXPRESS, cannelloni->Init.express_count * 8);
+  for (uint8_t i = 0; i < cannelloni->Init.express_count; i++) {
+    p = put_u32(p, cannelloni->Init.express[i].id);
+    p = put_u32(p, cannelloni->Init.express[i].mask);
+  }
+
+  p = put_u16(put_param(p, CTL_TX_MAX_AGE, 2), cannelloni->Init.tx_max_age_ms);
+  p = put_param(p, CTL_TX_COALESCE, 1);
+  *p++ = cannelloni->Init.tx_coalesce;
+
+  p = put_u32(put_param(p, CTL_TX_EXPIRED, 4), cannelloni->tx_expired);
+  p = put_u32(put_param(p, CTL_TX_COALESCED, 4), cannelloni->tx_coalesced);
+  p = put_u32(put_param(p, CTL_SEND_DROPPED, 4), cannelloni->retry.dropped);
+  return p;
+}
+
+static void handle_control(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, uint16_t port) {
+  // only hosts on the gateway's own link may reconfigure it
+  if (!control_request.pending && ip6_addr_islinklocal(ip_2_ip6(addr))) {
+    control_request.len = pbuf_copy_partial(p, control_request.data, sizeof(control_request.data), 0);
+    ip_addr_copy(control_request.addr, *addr);
+    control_request.port = port;
+    control_request.pending = true;
+  }
+  pbuf_free(p);
+}
+
+void run_control(void) {
+  SYS_ARCH_DECL_PROTECT(lev);
+  SYS_ARCH_PROTECT(lev);
+  bool pending = control_request.pending;
+  SYS_ARCH_UNPROTECT(lev);
+  if (!pending) {
+    return;
+  }
+
+  const uint8_t *request = control_request.data;
+  uint16_t len = control_request.len;
+  struct pbuf *reply = NULL;
+  if (len >= CTL_HEADER_SIZE && request[0] == CTL_VERSION) {
+    reply = pbuf_alloc(PBUF_TRANSPORT, CTL_REPLY_SIZE, PBUF_RAM);
+  }
+  if (!reply) {
+    control_request.pending = false;
+    return;
+  }
+  uint8_t *data = (uint8_t *)reply->payload;
+  data[0] = CTL_VERSION;
+  data[1] = request[1] | CTL_REPLY;
+  data[2] = request[2];
+  data[3] = request[3];
+
+  uint8_t *end = &data[5];
+  uint8_t channel = request[3];
+  if (channel >= CAN_IFACES) {
+    data[4] = CTL_BAD_CHANNEL;
+  } else if (request[1] == CTL_GET) {
+    data[4] = CTL_OK;
+  } else if (request[1] == CTL_SET) {
+    data[4] = control_set(&can_interfaces[channel], &request[CTL_HEADER_SIZE], len - CTL_HEADER_SIZE);
+  } else {
+    data[4] = CTL_BAD_REQUEST;
+  }
+  if (channel < CAN_IFACES) {
+    end = control_report(&can_interfaces[channel], end);
+  }
+
+  reply->tot_len = reply->len = end - data;
+  udp_sendto(control_pcb, reply, &control_request.addr, control_request.port);
+  pbuf_free(reply);
+  control_request.pending = false;
+}
+
+void init_control(void) {
+  control_pcb = udp_new_ip_type(IPADDR_TYPE_V6);
+  if (control_pcb == NULL) {
+    return;
+  }
+  if (udp_bind(control_pcb, IP6_ADDR_ANY, CONTROL_PORT)) {
+    return;
+  }
+  udp_recv(control_pcb, handle_control, NULL);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Per-channel tuning over UDP, accepted from link-local addresses only.
+ *
+ * Request:  version, op, seq, channel, then for CTL_SET the parameters to change
+ * Response: version, op | CTL_REPLY, seq, channel, status, then every parameter
+ *
+ * Parameters are encoded as type, length, value; multi-byte values are big endian.
+ */
+
+#define CONTROL_PORT 19999
+#define CTL_VERSION 1
+#define CTL_HEADER_SIZE 4
+#define CTL_REPLY 0x80
+
+enum ctl_op { CTL_GET,
+              CTL_SET };
+
+enum ctl_status { CTL_OK,
+                  CTL_BAD_REQUEST,
+                  CTL_BAD_CHANNEL,
+                  CTL_REJECTED };
+
+enum ctl_param {
+  /* u16: frames queued before a datagram is sent */
+  CTL_BATCH_FRAMES = 1,
+  /* u16: ms the oldest queued frame may wait for more */
+  CTL_BATCH_TIMEOUT,
+  /* u32 bit/s, optionally followed by a u16 sample point in per mille */
+  CTL_BITRATE,
+  /* u32 ID, u32 mask per acceptance filter, CAN_MSGID_EXTENDED marks extended IDs */
+  CTL_FILTERS,
+  /* 16 byte IPv6 address, u16 port per destination, none restores the multicast group */
+  CTL_DESTINATIONS,
+  /* u8 enum cnl_queue_policy */
+  CTL_QUEUE_POLICY,
+  /* u32 ID, u32 mask per match of frames that skip batching, CAN_MSGID_EXTENDED marks extended IDs */
+  CTL_EXPRESS,
+  /* u16: ms a frame for the bus may wait in the queue, 0 for no limit */
+  CTL_TX_MAX_AGE,
+  /* u8: 1 lets a frame for the bus replace the queued one with the same ID */
+  CTL_TX_COALESCE,
+  /* u32, reported only: frames for the bus dropped past CTL_TX_MAX_AGE since boot */
+  CTL_TX_EXPIRED,
+  /* u32, reported only: queued payloads for the bus replaced by coalescing since boot */
+  CTL_TX_COALESCED,
+  /* u32, reported only: received frames dropped after CNL_SEND_RETRIES failed sends since boot */
+  CTL_SEND_DROPPED,
+};
+
+void init_control(void);
+
+/* Applies and answers a request received meanwhile, call from the main loop */
+void run_control(void);
@@ -1,6 +1,6 @@
 #include "can.h"
+#include "HL_system.h"
 
-#define CAN_MSGID_EXTENDED (1U << 31)
 #define CAN_MSGID_XTD_MASK ((1U << 29) - 1U)
 #define CAN_MSGID_STD_MASK ((1U << 11) - 1U)
 
@@ -30,6 +30,7 @@
 #define DCAN_IFCMD_DATAA_SHIFT 1
 #define DCAN_IFCMD_DATAB_SHIFT 0
 
+#define DCAN_IFMSK_MXTD_SHIFT 31
 #define DCAN_IFMSK_MDIR_SHIFT 30
 
 #define DCAN_CTL_SECDED_DISABLE 0x5U
@@ -43,36 +44,186 @@
 #define DCAN_BTR_TSEG2_SHIFT 12
 #define DCAN_BTR_BRPE_SHIFT 16
 
+// DCAN runs from VCLK1, bit timing limits in time quanta
+#define DCAN_CLOCK_HZ ((uint32_t)(VCLK1_FREQ * 1000000.0F))
+#define DCAN_BRP_MAX 1024U
+#define DCAN_TQ_MIN 8U
+#define DCAN_TQ_MAX 25U
+#define DCAN_TSEG1_MIN 2U
+#define DCAN_TSEG1_MAX 16U
+#define DCAN_TSEG2_MIN 1U
+#define DCAN_TSEG2_MAX 8U
+#define DCAN_SJW_MAX 4U
+#define CAN_BITRATE_MAX 1000000U
+
 #define DCAN_IOC_PU_SHIFT 18
 #define DCAN_IOC_FUNC_SHIFT 3
 
 static const uint32_t data_byte_order[8U] = {3U, 2U, 1U, 0U, 7U, 6U, 5U, 4U};
 
+// IF1 serves receiving and mailbox setup in the main loop, IF2 sending, which may run from an interrupt
 static void can_if_wait_ready(canBASE_t *canreg) {
   while ((canreg->IF1STAT & 0x80U) == 0x80U) {
   }
 }
 
-void can_init(canBASE_t *canreg) {
+static void can_if2_wait_ready(canBASE_t *canreg) {
+  while ((canreg->IF2STAT & 0x80U) == 0x80U) {
+  }
+}
+
+static bool can_mbox_pending(canBASE_t *canreg, uint8_t mbox) {
+  return canreg->NWDATx[(mbox - 1U) >> 5U] & (1U << ((mbox - 1U) & 0x1FU));
+}
+
+// IDs in the arbitration/mask register layout
+static uint32_t can_arb_id(uint32_t id) {
+  if (id & CAN_MSGID_EXTENDED) {
+    return id & CAN_MSGID_XTD_MASK;
+  }
+  return (id & CAN_MSGID_STD_MASK) << DCAN_IFARB_ID_STD_SHIFT;
+}
+
+static void can_rx_mbox_setup(canBASE_t *canreg, uint8_t mbox, uint32_t msk, uint32_t arb, bool eob) {
+  can_if_wait_ready(canreg);
+  canreg->IF1MSK = msk;
+  canreg->IF1ARB = (1U << DCAN_IFARB_MSGVAL_SHIFT) | arb;
+  canreg->IF1MCTL = (1U << DCAN_IFMCTL_UMASK_SHIFT) | (eob << DCAN_IFMCTL_EOB_SHIFT) | (1U << DCAN_IFMCTL_RXIE_SHIFT);
+  canreg->IF1CMD = (1U << DCAN_IFCMD_WRRD_SHIFT) | (1U << DCAN_IFCMD_MASK_SHIFT) | (1U << DCAN_IFCMD_ARB_SHIFT) | (1U << DCAN_IFCMD_CONTROL_SHIFT) | (1U << DCAN_IFCMD_CLRINTPND_SHIFT);
+  canreg->IF1NO = mbox;
+}
+
+static void can_write_btr(canBASE_t *canreg, const struct can_bit_timing *bt) {
+  uint32_t brp = bt->brp - 1U;
+  canreg->BTR = ((brp >> 6) << DCAN_BTR_BRPE_SHIFT) | ((bt->tseg2 - 1U) << DCAN_BTR_TSEG2_SHIFT) | ((bt->tseg1 - 1U) << DCAN_BTR_TSEG1_SHIFT) | ((bt->sjw - 1U) << DCAN_BTR_SJW_SHIFT) | ((brp & 0x3FU) << DCAN_BTR_BRP_SHIFT);
+}
+
+static uint32_t abs_diff(uint32_t a, uint32_t b) {
+  return a > b ? a - b : b - a;
+}
+
+bool can_calc_bit_timing(uint32_t clock, uint32_t bitrate, uint16_t sample_point, struct can_bit_timing *bt) {
+  if (bitrate == 0 || bitrate > CAN_BITRATE_MAX) {
+    return false;
+  }
+  // CiA recommendations, later sampling tolerates longer buses at low rates
+  if (sample_point == 0) {
+    sample_point = bitrate > 800000U ? 750U : bitrate > 500000U ? 800U : 875U;
+  }
+
+  uint32_t best_rate_err = UINT32_MAX;
+  uint32_t best_sp_err = UINT32_MAX;
+  for (uint32_t tq = DCAN_TQ_MAX; tq >= DCAN_TQ_MIN; tq--) {
+    uint32_t brp = (clock + bitrate * tq / 2U) / (bitrate * tq);
+    if (brp == 0 || brp > DCAN_BRP_MAX) {
+      continue;
+    }
+
+    // the sample point falls after the sync quantum and TSEG1
+    uint32_t tseg2 = tq - (tq * sample_point + 500U) / 1000U;
+    tseg2 = tseg2 < DCAN_TSEG2_MIN ? DCAN_TSEG2_MIN : tseg2 > DCAN_TSEG2_MAX ? DCAN_TSEG2_MAX : tseg2;
+    uint32_t tseg1 = tq - 1U - tseg2;
+    if (tseg1 > DCAN_TSEG1_MAX) {
+      tseg1 = DCAN_TSEG1_MAX;
+      tseg2 = tq - 1U - tseg1;
+    }
+    if (tseg1 < DCAN_TSEG1_MIN || tseg2 > DCAN_TSEG2_MAX) {
+      continue;
+    }
+
+    uint32_t rate_err = abs_diff(clock / (brp * tq), bitrate);
+    // within 1% any sample point will do, more quanta give a finer resync
+    uint32_t sp_err = abs_diff(1000U * (tq - tseg2) / tq, sample_point) / 10U;
+    if (rate_err < best_rate_err || (rate_err == best_rate_err && sp_err < best_sp_err)) {
+      best_rate_err = rate_err;
+      best_sp_err = sp_err;
+      bt->brp = brp;
+      bt->tseg1 = tseg1;
+      bt->tseg2 = tseg2;
+      bt->sjw = tseg2 < DCAN_SJW_MAX ? tseg2 : DCAN_SJW_MAX;
+    }
+  }
+
+  // more than 1% off won't interoperate with the other nodes
+  return best_rate_err <= bitrate / 100U;
+}
+
+bool can_init(canBASE_t *canreg, uint32_t bitrate) {
   canreg->CTL = (DCAN_CTL_SECDED_DISABLE << DCAN_CTL_SECDED_SHIFT) | (1U << DCAN_CTL_INIT_SHIFT) | (1U << DCAN_CTL_CCE_SHIFT);
 
   // 1 mbox for TX, 2-64 mboxes reserved for RX
   for (int mbox = CAN_RX_QUEUE_FIRST_MBOX; mbox <= CAN_MBOX_LAST; mbox++) {
-    can_if_wait_ready(canreg);
-    canreg->IF1MSK = 1U << DCAN_IFMSK_MDIR_SHIFT;
-    canreg->IF1ARB = (1U << DCAN_IFARB_MSGVAL_SHIFT) | (1U << DCAN_IFARB_XTD_SHIFT);
-    canreg->IF1MCTL = (1U << DCAN_IFMCTL_UMASK_SHIFT) | ((mbox == 64) << DCAN_IFMCTL_EOB_SHIFT) | (1U << DCAN_IFMCTL_RXIE_SHIFT);
-    canreg->IF1CMD = (1U << DCAN_IFCMD_WRRD_SHIFT) | (1U << DCAN_IFCMD_MASK_SHIFT) | (1U << DCAN_IFCMD_ARB_SHIFT) | (1U << DCAN_IFCMD_CONTROL_SHIFT) | (1U << DCAN_IFCMD_CLRINTPND_SHIFT);
-    canreg->IF1NO = mbox;
+    can_rx_mbox_setup(canreg, mbox, 1U << DCAN_IFMSK_MDIR_SHIFT, 1U << DCAN_IFARB_XTD_SHIFT, mbox == CAN_MBOX_LAST);
   }
 
-  canreg->BTR = (0 << DCAN_BTR_BRPE_SHIFT) | ((4U - 1U) << DCAN_BTR_TSEG2_SHIFT) | ((6U + 4U - 1U) << DCAN_BTR_TSEG1_SHIFT) | ((4U - 1U) << DCAN_BTR_SJW_SHIFT) | (9U << DCAN_BTR_BRP_SHIFT);
-
   // set rx/tx to CAN func
   canreg->RIOC = canreg->TIOC = (1U << DCAN_IOC_PU_SHIFT) | (1U << DCAN_IOC_FUNC_SHIFT);
 
+  // an unreachable bitrate keeps the controller off the bus instead of disturbing it
+  struct can_bit_timing bt;
+  if (!can_calc_bit_timing(DCAN_CLOCK_HZ, bitrate, 0, &bt)) {
+    return false;
+  }
+  can_write_btr(canreg, &bt);
+
   // go to normal operation
   canreg->CTL &= ~((1U << DCAN_CTL_INIT_SHIFT) | (1U << DCAN_CTL_CCE_SHIFT));
+  return true;
+}
+
+bool can_set_bitrate(canBASE_t *canreg, uint32_t bitrate, uint16_t sample_point) {
+  struct can_bit_timing bt;
+  if (!can_calc_bit_timing(DCAN_CLOCK_HZ, bitrate, sample_point, &bt)) {
+    return false;
+  }
+
+  // BTR is only writable in init mode, the mailboxes keep their configuration
+  canreg->CTL |= (1U << DCAN_CTL_INIT_SHIFT) | (1U << DCAN_CTL_CCE_SHIFT);
+  can_write_btr(canreg, &bt);
+  canreg->CTL &= ~((1U << DCAN_CTL_INIT_SHIFT) | (1U << DCAN_CTL_CCE_SHIFT));
+  return true;
+}
+
+bool can_set_filters(canBASE_t *canreg, const struct can_filter *filters, uint8_t count) {
+  if (count > CAN_FILTERS_MAX) {
+    count = CAN_FILTERS_MAX;
+  }
+
+  // each filter gets its own FIFO of mailboxes, the last one takes the remainder
+  uint8_t mboxes = CAN_MBOX_LAST - CAN_RX_QUEUE_FIRST_MBOX + 1;
+  uint8_t per_filter = count ? mboxes / count : mboxes;
+  bool done = true;
+  for (int mbox = CAN_RX_QUEUE_FIRST_MBOX; mbox <= CAN_MBOX_LAST; mbox++) {
+    // the controller stays on the bus, mailboxes holding an unread frame are left for the next call
+    if (can_mbox_pending(canreg, mbox)) {
+      done = false;
+      continue;
+    }
+
+    if (count == 0) {
+      can_rx_mbox_setup(canreg, mbox, 1U << DCAN_IFMSK_MDIR_SHIFT, 1U << DCAN_IFARB_XTD_SHIFT, mbox == CAN_MBOX_LAST);
+      continue;
+    }
+
+    uint8_t fifo = (mbox - CAN_RX_QUEUE_FIRST_MBOX) / per_filter;
+    if (fifo >= count) {
+      fifo = count - 1;
+    }
+
+    const struct can_filter *filter = &filters[fifo];
+    bool xtd = filter->id & CAN_MSGID_EXTENDED;
+    bool eob = mbox == CAN_MBOX_LAST || (fifo < count - 1 && (mbox - CAN_RX_QUEUE_FIRST_MBOX + 1) % per_filter == 0);
+    can_rx_mbox_setup(canreg, mbox,
+                      (1U << DCAN_IFMSK_MXTD_SHIFT) | (1U << DCAN_IFMSK_MDIR_SHIFT) | can_arb_id(filter->mask | (filter->id & CAN_MSGID_EXTENDED)),
+                      (xtd << DCAN_IFARB_XTD_SHIFT) | can_arb_id(filter->id),
+                      eob);
+  }
+  return done;
+}
+
+uint64_t can_rx_pending(canBASE_t *canreg) {
+  uint64_t pending = ((uint64_t)canreg->NWDATx[1] << 32) | canreg->NWDATx[0];
+  return pending & ~((1ULL << (CAN_RX_QUEUE_FIRST_MBOX - 1U)) - 1U);
 }
 
 bool can_mbox_has_data(canBASE_t *canreg, uint8_t mbox) {
@@ -115,23 +266,21 @@ bool can_send(canBASE_t *canreg, uint32_t id, uint8_t dlc, const uint8_t *data)
     return false;
   }
 
-  can_if_wait_ready(canreg);
+  can_if2_wait_ready(canreg);
 
-  canreg->IF1ARB = (1U << DCAN_IFARB_MSGVAL_SHIFT) | (1U << DCAN_IFARB_DIR_SHIFT);
+  canreg->IF2ARB = (1U << DCAN_IFARB_MSGVAL_SHIFT) | (1U << DCAN_IFARB_DIR_SHIFT) | can_arb_id(id);
   if (id & CAN_MSGID_EXTENDED) {
-    canreg->IF1ARB |= (1U << DCAN_IFARB_XTD_SHIFT) | (id & CAN_MSGID_XTD_MASK);
-  } else {
-    canreg->IF1ARB |= (id & CAN_MSGID_STD_MASK) << DCAN_IFARB_ID_STD_SHIFT;
+    canreg->IF2ARB |= 1U << DCAN_IFARB_XTD_SHIFT;
   }
 
-  canreg->IF1MCTL = (1U << DCAN_IFMCTL_NEWDAT_SHIFT) |
+  canreg->IF2MCTL = (1U << DCAN_IFMCTL_NEWDAT_SHIFT) |
                     (1U << DCAN_IFMCTL_TXRQST_SHIFT) |
                     (dlc << DCAN_IFMCTL_DLC_SHIFT);
 
   for (int i = 0; i < dlc; i++) {
-    canreg->IF1DATx[data_byte_order[i]] = data[i];
+    canreg->IF2DATx[data_byte_order[i]] = data[i];
   }
-  canreg->IF1CMD = (uint8_t)0xFFU;
-  canreg->IF1NO = 1;
+  canreg->IF2CMD = (uint8_t)0xFFU;
+  canreg->IF2NO = 1;
   return true;
 }
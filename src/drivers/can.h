@@ -5,8 +5,40 @@
 
 #define CAN_RX_QUEUE_FIRST_MBOX 2
 #define CAN_MBOX_LAST 64
+#define CAN_FILTERS_MAX 8
 
-void can_init(canBASE_t *canreg);
+// set in IDs of extended frames
+#define CAN_MSGID_EXTENDED (1U << 31)
+
+// accepts frames whose ID matches id in all bits set in mask
+struct can_filter {
+  uint32_t id;
+  uint32_t mask;
+};
+
+// bit time in time quanta: 1 sync + tseg1 before the sample point + tseg2 after it
+struct can_bit_timing {
+  uint16_t brp;
+  uint8_t tseg1;
+  uint8_t tseg2;
+  uint8_t sjw;
+};
+
+// timing for bitrate in bit/s sampled at sample_point per mille (0 picks the CiA default),
+// false when the clock can't produce it within 1%
+bool can_calc_bit_timing(uint32_t clock, uint32_t bitrate, uint16_t sample_point, struct can_bit_timing *bt);
+
+// false leaves the controller off the bus, the bitrate can't be reached
+bool can_init(canBASE_t *canreg, uint32_t bitrate);
+// briefly leaves the bus to switch the bitrate, false keeps the current one
+bool can_set_bitrate(canBASE_t *canreg, uint32_t bitrate, uint16_t sample_point);
+// reprograms the RX mailboxes, no filters accept every frame; returns false while
+// some mailboxes still hold unread frames, call again once they are received
+bool can_set_filters(canBASE_t *canreg, const struct can_filter *filters, uint8_t count);
+// bit n - 1 set for every RX mailbox n with a new frame
+uint64_t can_rx_pending(canBASE_t *canreg);
 bool can_mbox_has_data(canBASE_t *canreg, uint8_t mbox);
 void can_fill_rx_mbox(canBASE_t *canreg, uint8_t mbox, uint32_t *id, uint8_t *len, uint8_t *data);
+// writes mailbox 1 through IF2, so it may interrupt the main loop's receives and filter updates on IF1;
+// callers from both contexts must not interrupt each other
 bool can_send(canBASE_t *canreg, uint32_t id, uint8_t dlc, const uint8_t *data);
@@ -1,8 +1,12 @@
 #include "timer.h"
 #include "HL_reg_rti.h"
+#include "HL_system.h"
 #include "drivers/vim.h"
 
 #define RTI_INT_CMP0 1U
+#define RTI_GCTRL_CNT1EN (1U << 1)
+// counter 1 counts microseconds, its compare registers stay unused
+#define RTI_US_PRESCALE ((uint32_t)RTI_FREQ - 1U)
 
 #define RTI_GCTRL_NTUSEL_NTU1 0x5U
 #define RTI_GCTRL_NTUSEL_SHIFT 16
@@ -31,6 +35,14 @@ void timer_init(void) {
   rtiREG1->INTFLAG = RTI_INT_CMP0;
   rtiREG1->SETINTENA = RTI_INT_CMP0;
 
-  // start the counter
-  rtiREG1->GCTRL |= ((uint32_t)1U << (0 & 3U));
+  rtiREG1->CNT[1U].UCx = 0U;
+  rtiREG1->CNT[1U].FRCx = 0U;
+  rtiREG1->CNT[1U].CPUCx = RTI_US_PRESCALE;
+
+  // start the counters
+  rtiREG1->GCTRL |= ((uint32_t)1U << (0 & 3U)) | RTI_GCTRL_CNT1EN;
+}
+
+uint32_t timer_us(void) {
+  return rtiREG1->CNT[1U].FRCx;
 }
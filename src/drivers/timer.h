@@ -4,3 +4,6 @@
 extern volatile uint32_t tick_ms;
 
 void timer_init();
+
+// free-running microseconds since timer_init(), wraps after about 71 minutes
+uint32_t timer_us(void);
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "drivers/can.h"
+#include "cannelloni.h"
+
+#define CAN_IFACES 4
+/* Frames per queue, queues are masked rings of a power of two */
+#define CNL_BUF_SIZE 128
+
+struct CANFilters {
+  uint8_t count;
+  struct can_filter filters[CAN_FILTERS_MAX];
+};
+
+struct CANInterface {
+  cannelloni_handle_t cannelloni;
+  struct canfd_frame tx_buf[CNL_BUF_SIZE];
+  struct canfd_frame rx_buf[CNL_BUF_SIZE];
+  canBASE_t *canreg;
+  // bit/s, 0 while the controller is off the bus
+  uint32_t bitrate;
+  // per mille, 0 for the CiA default
+  uint16_t sample_point;
+  // acceptance filters waiting to be programmed into the mailboxes
+  struct CANFilters filters;
+  bool filters_pending;
+};
+
+extern struct CANInterface can_interfaces[CAN_IFACES];
+
+// replaces the channel's acceptance filters, applied from the main loop between receives
+void set_can_filters(struct CANInterface *iface, const struct can_filter *filters, uint8_t count);
+// switches the channel's bitrate and re-announces it, main loop only; false keeps the current one
+bool set_can_bitrate(struct CANInterface *iface, uint32_t bitrate, uint16_t sample_point);
@@ -24,5 +24,10 @@
 #define LWIP_NUM_NETIF_CLIENT_DATA 1
 #define MEMP_NUM_SYS_TIMEOUT 8
 #define MDNS_MAX_SERVICES 4
+// mDNS, 4 channels, the mux and the control port
+#define MEMP_NUM_UDP_PCB 7
 #define LWIP_SKIP_PACKING_CHECK 1
 #define LWIP_SINGLE_NETIF 1
+// cannelloni's raw Ethernet transport takes its EtherType before lwIP drops the frame
+#define LWIP_HOOK_FILENAME "cannelloni.h"
+#define LWIP_HOOK_UNKNOWN_ETH_PROTOCOL(p, netif) cannelloni_eth_input(p, netif)
@@ -12,9 +12,16 @@
 #include "drivers/timer.h"
 #include "drivers/vim.h"
 #include "cannelloni.h"
+#include "control.h"
+#include "gateway.h"
 
-#define CAN_IFACES 4
-#define CNL_BUF_SIZE 128
+#define NODES 3
+// send the frames of all channels in shared datagrams, only for bridges that demultiplex them
+#define CNL_MUX 0
+// CNL_TRANSPORT_ETH skips IP/UDP and sends datagrams in raw Ethernet frames, for bridges on the same link
+#define CNL_TRANSPORT CNL_TRANSPORT_UDP
+// frames carry their receive time from the RTI, in a format only cannelloni_bridge understands
+#define CNL_TIMESTAMPS 0
 
 extern struct netif netif;
 int instNum = 0;
@@ -22,14 +29,26 @@ int instNum = 0;
 void DP8386_init();
 void SJA1105_init();
 
-struct CANInterface {
-  cannelloni_handle_t cannelloni;
-  struct canfd_frame tx_buf[CNL_BUF_SIZE];
-  struct canfd_frame rx_buf[CNL_BUF_SIZE];
-  canBASE_t *canreg;
-};
-
 struct CANInterface can_interfaces[CAN_IFACES];
+cannelloni_mux_t mux;
+// the bridge's clock, steered by the time requests it sends to any channel
+cnl_clock_t node_clock;
+
+// acceptance filters per channel at boot, e.g. {1, {{0x100, 0x700}}} passes only IDs 0x100-0x1ff
+static const struct CANFilters can_filters[CAN_IFACES] = {{0}};
+
+// frames that skip batching per channel, e.g. {1, {{0x700, 0x780}}} for CANopen heartbeats
+static const struct {
+  uint8_t count;
+  struct cnl_id_match matches[CNL_EXPRESS_MAX];
+} can_express[CAN_IFACES] = {{0}};
+
+// bitrate of every channel in the cluster, by node and channel
+static const uint32_t can_bitrates[NODES][CAN_IFACES] = {
+    {500000, 500000, 500000, 500000},
+    {500000, 500000, 500000, 500000},
+    {500000, 500000, 500000, 500000},
+};
 
 uint8_t node_id() {
   switch (systemREG2->DIEIDL_REG0) {
@@ -44,22 +63,72 @@ uint8_t node_id() {
 
 bool on_can_transmit(cannelloni_handle_t *cannelloni, struct canfd_frame *frame) {
   struct CANInterface *iface = cannelloni;
-  return can_send(iface->canreg, frame->can_id, frame->len, frame->data);
+  // the DCAN is classic CAN, decode_frames() keeps FD frames away from it
+  return can_send(iface->canreg, frame->can_id, canfd_len(frame), frame->data);
 }
 
 void on_can_receive(cannelloni_handle_t *cannelloni) {
   struct CANInterface *iface = cannelloni;
   canBASE_t *canreg = iface->canreg;
 
-  uint8_t mbox = CAN_RX_QUEUE_FIRST_MBOX;
-  while (can_mbox_has_data(canreg, mbox)) {
+  // with filters the mailboxes form several FIFOs, visit every one holding a frame
+  uint64_t pending = can_rx_pending(canreg);
+  for (uint8_t mbox = CAN_RX_QUEUE_FIRST_MBOX; mbox <= CAN_MBOX_LAST && pending >> (mbox - 1U); mbox++) {
+    if (!(pending & (1ULL << (mbox - 1U))) || !can_mbox_has_data(canreg, mbox)) {
+      continue;
+    }
+
     struct canfd_frame *frame = get_can_rx_frame(cannelloni);
     if (!frame) {
       return;
     }
 
+    frame->timestamp = timer_us();
     can_fill_rx_mbox(canreg, mbox, &frame->can_id, &frame->len, frame->data);
-    mbox++;
+    commit_can_rx_frame(cannelloni);
+  }
+}
+
+void set_can_filters(struct CANInterface *iface, const struct can_filter *filters, uint8_t count) {
+  iface->filters.count = count < CAN_FILTERS_MAX ? count : CAN_FILTERS_MAX;
+  memcpy(iface->filters.filters, filters, iface->filters.count * sizeof(*filters));
+  iface->filters_pending = true;
+}
+
+bool set_can_bitrate(struct CANInterface *iface, uint32_t bitrate, uint16_t sample_point) {
+  if (!can_set_bitrate(iface->canreg, bitrate, sample_point)) {
+    return false;
+  }
+  iface->bitrate = bitrate;
+  iface->sample_point = sample_point;
+  mdns_resp_announce(&netif);
+  return true;
+}
+
+static void srv_txt(struct mdns_service *service, void *txt_userdata) {
+  struct CANInterface *iface = txt_userdata;
+  char txt[24];
+  int len = snprintf(txt, sizeof(txt), "bitrate=%lu", (unsigned long)iface->bitrate);
+  mdns_resp_add_service_txtitem(service, txt, len);
+  len = snprintf(txt, sizeof(txt), "control=%u", CONTROL_PORT);
+  mdns_resp_add_service_txtitem(service, txt, len);
+  len = snprintf(txt, sizeof(txt), "channel=%d", (int)(iface - can_interfaces));
+  mdns_resp_add_service_txtitem(service, txt, len);
+  if (CNL_MUX) {
+    len = snprintf(txt, sizeof(txt), "mux=%u", mux.Init.port);
+    mdns_resp_add_service_txtitem(service, txt, len);
+  }
+  if (CNL_TRANSPORT == CNL_TRANSPORT_ETH) {
+    mdns_resp_add_service_txtitem(service, "transport=eth", 13);
+  }
+  if (iface->cannelloni.Init.can_fd) {
+    mdns_resp_add_service_txtitem(service, "fd=1", 4);
+  }
+}
+
+static void apply_can_filters(struct CANInterface *iface) {
+  if (iface->filters_pending && can_set_filters(iface->canreg, iface->filters.filters, iface->filters.count)) {
+    iface->filters_pending = false;
   }
 }
 
@@ -67,6 +136,8 @@ int main(void) {
   systemInit();
   vim_init();
   timer_init();
+  node_clock.Init.local_fn = timer_us;
+  init_cnl_clock(&node_clock);
 
   // set transceiver STBY to 1
   hetREG1->DOUT = 1U;
@@ -100,23 +171,48 @@ int main(void) {
         ((0xFF00U | IP6_MULTICAST_SCOPE_LINK_LOCAL) << 16) | (IP6_ADDR_BLOCK2(&cannelloni->Init.addr)));
 
     cannelloni->Init.can_buf_size = CNL_BUF_SIZE;
-    cannelloni->Init.can_rx_buf = can_interfaces->rx_buf;
+    cannelloni->Init.can_rx_buf = can_iface->rx_buf;
     cannelloni->Init.can_rx_fn = on_can_receive;
-    cannelloni->Init.can_tx_buf = can_interfaces->tx_buf;
+    cannelloni->Init.can_tx_buf = can_iface->tx_buf;
     cannelloni->Init.can_tx_fn = on_can_transmit;
     cannelloni->Init.port = 20000 + node_id() * 10 + i;
     cannelloni->Init.remote_port = cannelloni->Init.port;
+    cannelloni->Init.transport = CNL_TRANSPORT;
+    cannelloni->Init.netif = &netif;
+    cannelloni->Init.clock_fn = CNL_TIMESTAMPS ? timer_us : NULL;
+    cannelloni->Init.clock = &node_clock;
+    memcpy(cannelloni->Init.express, can_express[i].matches, sizeof(cannelloni->Init.express));
+    cannelloni->Init.express_count = can_express[i].count;
 
     canBASE_t *regs[] = {canREG1, canREG2, canREG3, canREG4};
     can_iface->canreg = regs[i];
-    can_init(regs[i]);
+    uint32_t bitrate = can_bitrates[node_id()][i];
+    can_iface->bitrate = can_init(regs[i], bitrate) ? bitrate : 0;
+    set_can_filters(can_iface, can_filters[i].filters, can_filters[i].count);
+    apply_can_filters(can_iface);
     init_cannelloni(cannelloni);
 
     char srv_name[16];
     snprintf(srv_name, sizeof(srv_name), "can-%d-%d", node_id(), i);
-    mdns_resp_add_service(&netif, srv_name, "_cannelloni", DNSSD_PROTO_UDP, cannelloni->Init.port, NULL, NULL);
+    mdns_resp_add_service(&netif, srv_name, "_cannelloni", DNSSD_PROTO_UDP, cannelloni->Init.port, srv_txt, can_iface);
   }
 
+  // the port after the channels' ports, to the same group
+  mux.Init.port = 20000 + node_id() * 10 + CAN_IFACES;
+  ip_addr_copy(mux.Init.addr, can_interfaces[0].cannelloni.Init.addr);
+  mux.Init.transport = CNL_TRANSPORT;
+  mux.Init.netif = &netif;
+  mux.Init.clock_fn = CNL_TIMESTAMPS ? timer_us : NULL;
+  if (CNL_MUX) {
+    for (int i = 0; i < CAN_IFACES; i++) {
+      mux.Init.channels[i] = &can_interfaces[i].cannelloni;
+    }
+    mux.Init.channel_count = CAN_IFACES;
+    init_cannelloni_mux(&mux);
+  }
+
+  init_control();
+
   if (node_id() == 2) {
     DP8386_init();
     SJA1105_init();
@@ -127,9 +223,12 @@ int main(void) {
 
   for (;;) {
     sys_check_timeouts();
+    run_control();
     for (int i = 0; i < CAN_IFACES; i++) {
       run_cannelloni(&can_interfaces[i].cannelloni);
+      apply_can_filters(&can_interfaces[i]);
     }
+    run_cannelloni_mux(&mux);
   }
 }
 
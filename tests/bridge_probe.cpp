@@ -0,0 +1,42 @@
+// the bridge's parsers and counters behind a command line for the pytest suite, built by conftest.py
+#define main cannelloni_bridge_main
+#include "../bridge/cannelloni_bridge.cpp"
+#undef main
+
+// filter <spec>: the CAN_RAW_FILTER rules as <can_id>:<can_mask> and the error mask as #<mask>, all hex
+static int probe_filter(const char *spec) {
+  CANFilter filter;
+  if (!parse_filter(spec, filter)) {
+    return 1;
+  }
+  for (uint8_t i = 0; i < filter.count; i++) {
+    printf("%08x:%08x\n", filter.rules[i].can_id, filter.rules[i].can_mask);
+  }
+  printf("#%08x\n", filter.err_mask);
+  return 0;
+}
+
+// latency <ns>...: the bucket each value is counted in and the largest value that bucket stands for
+static int probe_latency(int count, char **values) {
+  for (int i = 0; i < count; i++) {
+    LatencyHistogram histogram;
+    histogram.observe(strtoull(values[i], nullptr, 10));
+    for (size_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+      if (histogram.buckets[bucket].get()) {
+        printf("%zu %llu\n", bucket, (unsigned long long)LatencyHistogram::upper(bucket));
+      }
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "filter") == 0) {
+    return probe_filter(argv[2]);
+  }
+  if (argc >= 2 && strcmp(argv[1], "latency") == 0) {
+    return probe_latency(argc - 2, argv + 2);
+  }
+  fprintf(stderr, "Usage: %s filter <spec> | latency <ns>...\n", argv[0]);
+  return 2;
+}
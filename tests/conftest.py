@@ -0,0 +1,26 @@
+#!/usr/bin/env python3
+import os
+import subprocess
+import pytest
+
+TESTS = os.path.dirname(os.path.abspath(__file__))
+
+
+@pytest.fixture(scope='session')
+def bridge_probe(tmp_path_factory):
+    # built like bridge/Makefile does, CXXFLAGS and LDFLAGS point it at other headers and libraries
+    cxxflags = os.getenv('CXXFLAGS', '').split()
+    ldflags = os.getenv('LDFLAGS', '-lavahi-client -lavahi-common -lpthread').split()
+    headers = subprocess.run(['g++', '-E', '-x', 'c++', *cxxflags, '-'], input='#include <avahi-client/client.h>\n',
+                             capture_output=True, text=True)
+    if headers.returncode != 0:
+        pytest.skip('avahi-client headers missing')
+
+    probe = tmp_path_factory.mktemp('bridge') / 'bridge_probe'
+    subprocess.run(['g++', '-std=gnu++17', '-O2', *cxxflags, os.path.join(TESTS, 'bridge_probe.cpp'), '-o', str(probe), *ldflags],
+                   check=True)
+
+    def run(*args):
+        result = subprocess.run([str(probe), *map(str, args)], capture_output=True, text=True)
+        return result.returncode, result.stdout.split()
+    return run
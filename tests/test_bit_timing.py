@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+import ctypes
+import os
+import subprocess
+import pytest
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+# VCLK1_FREQ of TMS570LC435/HL_system.h
+VCLK1 = 75_000_000
+
+
+class CANBitTiming(ctypes.Structure):
+    _fields_ = [('brp', ctypes.c_uint16), ('tseg1', ctypes.c_uint8), ('tseg2', ctypes.c_uint8), ('sjw', ctypes.c_uint8)]
+
+
+@pytest.fixture(scope='module')
+def can_driver(tmp_path_factory):
+    lib = tmp_path_factory.mktemp('can') / 'can.so'
+    subprocess.run(['gcc', '-std=gnu99', '-shared', '-fPIC', '-I', os.path.join(ROOT, 'TMS570LC435'),
+                    os.path.join(ROOT, 'src/drivers/can.c'), '-o', str(lib)], check=True)
+    driver = ctypes.CDLL(str(lib))
+    driver.can_calc_bit_timing.argtypes = [ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint16, ctypes.POINTER(CANBitTiming)]
+    driver.can_calc_bit_timing.restype = ctypes.c_bool
+    return driver
+
+
+def calc(driver, bitrate, sample_point=0):
+    bt = CANBitTiming()
+    if not driver.can_calc_bit_timing(VCLK1, bitrate, sample_point, ctypes.byref(bt)):
+        return None
+    return (bt.brp, bt.tseg1, bt.tseg2, bt.sjw)
+
+
+# (brp, tseg1, tseg2, sjw) at the CiA sample points, 1 sync quantum + tseg1 + tseg2 per bit
+@pytest.mark.parametrize("bitrate, timing", [
+    (1000000, (5, 10, 4, 4)),
+    (500000, (10, 12, 2, 2)),
+    (250000, (20, 12, 2, 2)),
+    (125000, (40, 12, 2, 2)),
+    (100000, (50, 12, 2, 2)),
+    (83333, (60, 12, 2, 2)),
+    (50000, (100, 12, 2, 2)),
+    (20000, (250, 12, 2, 2)),
+    (10000, (500, 12, 2, 2)),
+])
+def test_table(can_driver, bitrate, timing):
+    assert calc(can_driver, bitrate) == timing
+
+
+@pytest.mark.parametrize("bitrate, sample_point, timing", [
+    (500000, 750, (10, 10, 4, 4)),
+    (500000, 875, (10, 12, 2, 2)),
+    (1000000, 750, (5, 10, 4, 4)),
+])
+def test_sample_point(can_driver, bitrate, sample_point, timing):
+    assert calc(can_driver, bitrate, sample_point) == timing
+
+
+@pytest.mark.parametrize("bitrate", [10000, 20000, 50000, 100000, 125000, 250000, 500000, 1000000])
+def test_limits(can_driver, bitrate):
+    brp, tseg1, tseg2, sjw = calc(can_driver, bitrate)
+    tq = 1 + tseg1 + tseg2
+    assert VCLK1 // (brp * tq) == bitrate
+    assert 1 <= brp <= 1024
+    assert 8 <= tq <= 25
+    assert 2 <= tseg1 <= 16
+    assert 1 <= tseg2 <= 8
+    assert sjw == min(tseg2, 4)
+
+
+# 800 kbit/s is 1.3% off at best from 75 MHz
+@pytest.mark.parametrize("bitrate", [0, 800000, 1000001, 2000000])
+def test_unreachable(can_driver, bitrate):
+    assert calc(can_driver, bitrate) is None
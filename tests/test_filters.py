@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+import pytest
+
+CAN_EFF_FLAG = 0x80000000
+CAN_INV_FILTER = 0x20000000
+
+
+def rule(can_id, can_mask):
+    return f"{can_id:08x}:{can_mask:08x}"
+
+
+@pytest.mark.parametrize("spec, rules, err_mask", [
+    ("100:700", [rule(0x100, 0x700)], 0),
+    ("0:0", [rule(0, 0)], 0),
+    ("7ff~7ff", [rule(0x7ff | CAN_INV_FILTER, 0x7ff)], 0),
+    # 8 digits make an extended ID, like candump
+    ("00000123:1fffffff", [rule(0x123 | CAN_EFF_FLAG, 0x1fffffff)], 0),
+    ("18fe0000~ffff00", [rule(0x18fe0000 | CAN_EFF_FLAG | CAN_INV_FILTER, 0xffff00)], 0),
+    ("#ffffffff", [], 0xffffffff),
+    ("123:7ff,00000123:1fffffff,#4", [rule(0x123, 0x7ff), rule(0x123 | CAN_EFF_FLAG, 0x1fffffff)], 4),
+    ("#4,100:700", [rule(0x100, 0x700)], 4),
+    (",".join(["1:7ff"] * 16), [rule(1, 0x7ff)] * 16, 0),
+], ids=str)
+def test_filter(bridge_probe, spec, rules, err_mask):
+    assert bridge_probe("filter", spec) == (0, rules + [f"#{err_mask:08x}"])
+
+
+@pytest.mark.parametrize("spec", [
+    "100",
+    "100:",
+    ":700",
+    "100;700",
+    "100:700;",
+    "#",
+    "#x",
+    "g00:700",
+    ",".join(["1:7ff"] * 17),
+], ids=str)
+def test_invalid_filter(bridge_probe, spec):
+    assert bridge_probe("filter", spec)[0] == 1
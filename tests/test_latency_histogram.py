@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+import pytest
+
+SUB_BUCKETS = 8
+BUCKETS = 256
+
+
+def lower(bucket):
+    """Smallest value counted in the bucket: 8 linear ones per power of two above the first 8 ns"""
+    if bucket < SUB_BUCKETS:
+        return bucket
+    exponent = bucket // SUB_BUCKETS + 2
+    return (SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 3)
+
+
+def observe(bridge_probe, values):
+    code, out = bridge_probe("latency", *values)
+    assert code == 0
+    return [(int(out[i]), int(out[i + 1])) for i in range(0, len(out), 2)]
+
+
+def test_linear_start(bridge_probe):
+    assert observe(bridge_probe, range(SUB_BUCKETS)) == [(ns, ns) for ns in range(SUB_BUCKETS)]
+
+
+def test_boundaries(bridge_probe):
+    buckets = range(1, BUCKETS - 1)
+    values = [v for b in buckets for v in (lower(b) - 1, lower(b), lower(b + 1) - 1)]
+    seen = observe(bridge_probe, values)
+    for i, b in enumerate(buckets):
+        assert seen[3 * i] == (b - 1, lower(b) - 1)
+        assert seen[3 * i + 1] == (b, lower(b + 1) - 1)
+        assert seen[3 * i + 2] == (b, lower(b + 1) - 1)
+
+
+@pytest.mark.parametrize("ns, bucket", [
+    (8, 8),
+    (15, 15),
+    (16, 16),
+    (17, 16),
+    (18, 17),
+    (1000, 63),
+    (1023, 63),
+    (1024, 64),
+    (1_000_000, 143),
+])
+def test_known(bridge_probe, ns, bucket):
+    assert observe(bridge_probe, [ns])[0][0] == bucket
+
+
+def test_overflow(bridge_probe):
+    # the last bucket takes everything from ~16 s on
+    assert [b for b, _ in observe(bridge_probe, [lower(BUCKETS - 1), 60 * 10**9, 2**63])] == [BUCKETS - 1] * 3
@@ -1,5 +1,10 @@
 #!/usr/bin/env python3
+import ipaddress
 import os
+import socket
+import struct
+import subprocess
+import time
 import can
 import pytest
 from collections import namedtuple
@@ -14,7 +19,6 @@ def create_cans(dir) -> tuple[can.Bus, can.bus]:
     return (a, b) if dir == 'rx' else (b, a)
 
 
-
 @pytest.mark.parametrize("dlc", range(0, 9))
 @pytest.mark.parametrize("msgid", [
     CANMsgID(0, False),
@@ -35,3 +39,164 @@ def test_dlc(dir, msgid, dlc):
     assert received.arbitration_id == msgid.arbitration_id
     assert received.is_extended_id == msgid.is_extended_id
     assert received.data == bytearray(range(dlc))
+
+
+# a bridge of its own on test vcans, talking to a fake gateway on GW_LINK's link-local address
+GW_LINK = os.getenv("GW_LINK", "eth0")
+LOOP_CANS = (os.getenv("CAN_LOOP0", "can-test-0"), os.getenv("CAN_LOOP1", "can-test-1"))
+CNL_DATA = 0
+CNL_MUX_DATA = 3
+CNL_OP_TIMESTAMPS = 0x40
+CAN_EFF_FLAG = 0x80000000
+
+
+def link_local(ifname) -> ipaddress.IPv6Address:
+    with open('/proc/net/if_inet6') as f:
+        for line in f:
+            addr, _, _, scope, _, name = line.split()
+            if name == ifname and scope == '20':
+                return ipaddress.IPv6Address(int(addr, 16))
+    pytest.skip(f"no link-local address on {ifname}")
+
+
+def encode(msgs, op=CNL_DATA, seq=0, sent=None, channels=None, ages=None) -> bytes:
+    """cannelloni datagram of msgs, with per frame channels for CNL_MUX_DATA and ages in us when sent is given"""
+    if sent is not None:
+        op |= CNL_OP_TIMESTAMPS
+    out = struct.pack('>BBBH', 2, op, seq, len(msgs))
+    if sent is not None:
+        out += struct.pack('>I', sent)
+    for i, msg in enumerate(msgs):
+        if channels is not None:
+            out += bytes([channels[i]])
+        if sent is not None:
+            out += struct.pack('>I', (sent - ages[i]) & 0xffffffff)
+        out += struct.pack('>IB', msg.arbitration_id | (CAN_EFF_FLAG if msg.is_extended_id else 0), len(msg.data))
+        out += bytes(msg.data)
+    return out
+
+
+def decode(datagram) -> list[can.Message]:
+    version, op, _, count = struct.unpack_from('>BBBH', datagram)
+    assert (version, op) == (2, CNL_DATA)
+    pos = 5
+    msgs = []
+    for _ in range(count):
+        canid, length = struct.unpack_from('>IB', datagram, pos)
+        pos += 5
+        msgs.append(can.Message(arbitration_id=canid & 0x1fffffff, is_extended_id=bool(canid & CAN_EFF_FLAG),
+                                data=datagram[pos:pos + length]))
+        pos += length
+    return msgs
+
+
+class Gateway:
+    """receives what the bridge sends to ports, sends to the group the bridge joins"""
+
+    def __init__(self, ports):
+        self.ifindex = socket.if_nametoindex(GW_LINK)
+        self.addr = link_local(GW_LINK)
+        self.group = ipaddress.IPv6Address(b'\xff\x02' + self.addr.packed[2:])
+        self.rx = {}
+        for port in ports:
+            sock = socket.socket(socket.AF_INET6, socket.SOCK_DGRAM)
+            sock.bind((str(self.addr), port, 0, self.ifindex))
+            self.rx[port] = sock
+        self.tx = socket.socket(socket.AF_INET6, socket.SOCK_DGRAM)
+        self.tx.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_MULTICAST_IF, self.ifindex)
+
+    def bridge(self, canif, port, mux=None) -> str:
+        arg = f"{canif}:{self.addr}%{GW_LINK}:{port}"
+        return arg if mux is None else arg + f",mux={mux[0]},channel={mux[1]}"
+
+    def send(self, port, datagram):
+        self.tx.sendto(datagram, (str(self.group), port, 0, self.ifindex))
+
+    def recv(self, port) -> list[can.Message]:
+        while True:
+            datagram = self.rx[port].recv(65536)
+            # skip the bridge's clock requests
+            if datagram[1] == CNL_DATA:
+                return decode(datagram)
+
+    def close(self):
+        for sock in self.rx.values():
+            sock.close()
+        self.tx.close()
+
+
+@pytest.fixture
+def gateway(request):
+    """starts ./bridge/cannelloni_bridge on the bridges of request.param's gateway"""
+    gw = Gateway(request.param['ports'])
+    bridge = subprocess.Popen([os.getenv("BRIDGE", "./bridge/cannelloni_bridge"),
+                               *(gw.bridge(*args) for args in request.param['bridges'])])
+    # every bridge is set up once its first clock request comes in, a second after start
+    for sock in gw.rx.values():
+        sock.settimeout(3)
+        sock.recv(65536)
+        sock.settimeout(1)
+    yield gw
+    bridge.terminate()
+    bridge.wait()
+    gw.close()
+
+
+def loop_msgs():
+    return [
+        can.Message(arbitration_id=0x42, is_extended_id=False, data=range(8)),
+        can.Message(arbitration_id=0x1fffffff, is_extended_id=True, data=range(3)),
+        can.Message(arbitration_id=0x7ff, is_extended_id=False, data=[]),
+    ]
+
+
+def assert_msgs(received, msgs):
+    assert len(received) == len(msgs)
+    for got, msg in zip(received, msgs):
+        assert got.arbitration_id == msg.arbitration_id
+        assert got.is_extended_id == msg.is_extended_id
+        assert got.data == bytearray(msg.data)
+
+
+def recv_all(bus, n) -> list[can.Message]:
+    return [bus.recv(1) for _ in range(n)]
+
+
+@pytest.mark.parametrize("gateway", [{'ports': [21000], 'bridges': [(LOOP_CANS[0], 21000)]}], indirect=True)
+@pytest.mark.parametrize("sent", [1_000_000, 5])
+def test_timestamped(gateway, sent):
+    bus = can.Bus(interface='socketcan', channel=LOOP_CANS[0])
+    msgs = loop_msgs()
+    # the gateway got the frames 3, 2 and 1 ms before sending them, 5 wraps its clock
+    gateway.send(21000, encode(msgs, sent=sent, ages=[3000, 2000, 1000]))
+    assert_msgs(recv_all(bus, len(msgs)), msgs)
+
+    for msg in msgs:
+        bus.send(msg)
+    received = []
+    while len(received) < len(msgs):
+        received += gateway.recv(21000)
+    assert_msgs(received, msgs)
+    bus.shutdown()
+
+
+@pytest.mark.parametrize("gateway", [{
+    'ports': [21010, 21011],
+    'bridges': [(LOOP_CANS[0], 21010, (21012, 0)), (LOOP_CANS[1], 21011, (21012, 1))],
+}], indirect=True)
+@pytest.mark.parametrize("sent", [None, 1_000_000])
+def test_mux(gateway, sent):
+    buses = [can.Bus(interface='socketcan', channel=name) for name in LOOP_CANS]
+    msgs = loop_msgs()
+    channels = [0, 1, 0]
+    gateway.send(21012, encode(msgs, CNL_MUX_DATA, sent=sent, channels=channels, ages=[3000, 2000, 1000]))
+    for channel, bus in enumerate(buses):
+        assert_msgs(recv_all(bus, channels.count(channel)), [m for m, c in zip(msgs, channels) if c == channel])
+        assert bus.recv(0.1) is None
+
+    # the gateway tells the channel by the port
+    for channel, bus in enumerate(buses):
+        bus.send(msgs[channel])
+        assert_msgs(gateway.recv(21010 + channel), [msgs[channel]])
+    for bus in buses:
+        bus.shutdown()
@@ -7,6 +7,7 @@ sudo ip link set can0 up
 
 create_vcan() {
   sudo ip link add name "$1" type vcan || true
+  sudo ip link set "$1" mtu 72  # CAN FD
   sudo ip link set "$1" up
 }
 
@@ -17,5 +18,9 @@ for node in 0 1 2; do
   create_vcan can-$node-3
 done
 
+# the test_msgs round trips run bridges of their own on these
+create_vcan can-test-0
+create_vcan can-test-1
+
 make -C bridge
 ./bridge/cannelloni_bridge